@@ -30,6 +30,9 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <stdlib.h>
 /*
 #ifdef HAVE_XKB
 #include <X11/XKBlib.h>
@@ -42,6 +45,7 @@
 #include <gdk/gdkx.h>
 
 #include "MwmUtil.h"
+#include "gdk-get-func.h"
 /*
 #include "gdkwindowimpl.h"
 #include "gdkasync.h"
@@ -77,68 +81,108 @@
   (GDK_WINDOW_TYPE (window) != GDK_WINDOW_CHILD &&   \
      GDK_WINDOW_TYPE (window) != GDK_WINDOW_OFFSCREEN)
 
-static MotifWmHints *
-gdk_xid_get_mwm_hints (Window window)
+/* The hints are 32-bit items on the wire, a long each in MotifWmHints */
+#define MWM_HINTS_ITEMS (sizeof (MotifWmHints) / sizeof (long))
+
+/**
+ * egg_xid_request_functions:
+ * @window: The toplevel #X11Window to get the functions for
+ *
+ * Sends the request for the MWM hints on @window without waiting for
+ * the reply, so other work can happen while it's on its way.  The
+ * cookie must be passed to #egg_xid_reply_functions or
+ * #egg_xid_discard_functions.
+ *
+ * Returns: A cookie for the request, never zero.
+ **/
+EggFunctionsCookie
+egg_xid_request_functions (Window window)
 {
-  GdkDisplay *display;
-  Atom hints_atom = None;
-  guchar *data = NULL;
-  Atom type;
-  gint format;
-  gulong nitems;
-  gulong bytes_after;
-  int ret = 0;
-  
-  display = gdk_display_get_default ();
-  
-  hints_atom = gdk_x11_get_xatom_by_name_for_display (display, _XA_MOTIF_WM_HINTS);
-
-  gdk_error_trap_push ();
-  XGetWindowProperty (GDK_DISPLAY_XDISPLAY (display), window,
-		      hints_atom, 0, sizeof (MotifWmHints)/sizeof (long),
-		      False, AnyPropertyType, &type, &format, &nitems,
-		      &bytes_after, &data);
-  gdk_flush ();
-  if ((ret = gdk_error_trap_pop ()))
-    {
-      g_warning ("%s: Unable to get hints for %u: Error Code: %d", G_STRFUNC, (guint32)window, ret);
-      return NULL;
-    }
+  xcb_connection_t *connection;
+  xcb_get_property_cookie_t cookie;
+
+  connection = XGetXCBConnection (gdk_x11_get_default_xdisplay ());
+
+  cookie = xcb_get_property (connection, FALSE, window,
+                             gdk_x11_get_xatom_by_name (_XA_MOTIF_WM_HINTS),
+                             XCB_GET_PROPERTY_TYPE_ANY, 0, MWM_HINTS_ITEMS);
 
-  if (type == None)
-    return NULL;
-  
-  return (MotifWmHints *)data;
+  return cookie.sequence;
 }
 
 /**
- * gdk_window_get_functions:
- * @window: The toplevel #X11Window to get the functions for
+ * egg_xid_reply_functions:
+ * @cookie: A cookie from #egg_xid_request_functions
  * @functions: The window functions will be written here
  *
- * Returns the functions set on the GdkWindow with #gdk_window_set_functions
+ * Collects the reply for @cookie, waiting for it if it hasn't
+ * arrived yet.
+ *
  * Returns: TRUE if the window has functions set, FALSE otherwise.
  **/
 gboolean
-egg_xid_get_functions (Window window,
-                       GdkWMFunction *functions)
+egg_xid_reply_functions (EggFunctionsCookie cookie,
+                         GdkWMFunction *functions)
 {
-  MotifWmHints *hints;
+  xcb_connection_t *connection;
+  xcb_get_property_cookie_t xcookie = { cookie };
+  xcb_get_property_reply_t *reply;
+  xcb_generic_error_t *error = NULL;
   gboolean result = FALSE;
 
-  hints = gdk_xid_get_mwm_hints (window);
-  
-  if (hints)
+  connection = XGetXCBConnection (gdk_x11_get_default_xdisplay ());
+
+  reply = xcb_get_property_reply (connection, xcookie, &error);
+  if (error != NULL)
+    {
+      g_warning ("%s: Unable to get hints: Error Code: %d", G_STRFUNC, error->error_code);
+      free (error);
+    }
+
+  if (reply == NULL)
+    return FALSE;
+
+  if (reply->type != XCB_NONE && reply->format == 32 &&
+      xcb_get_property_value_length (reply) >= (int) (2 * sizeof (guint32)))
     {
-      if (hints->flags & MWM_HINTS_FUNCTIONS)
+      guint32 *hints = xcb_get_property_value (reply);
+
+      if (hints[0] & MWM_HINTS_FUNCTIONS)
         {
           if (functions)
-            *functions = hints->functions;
+            *functions = hints[1];
           result = TRUE;
         }
-      
-      XFree (hints);
     }
 
+  free (reply);
+
   return result;
 }
+
+/**
+ * egg_xid_discard_functions:
+ * @cookie: A cookie from #egg_xid_request_functions
+ *
+ * Throws away the reply for @cookie, for when it's not wanted anymore.
+ **/
+void
+egg_xid_discard_functions (EggFunctionsCookie cookie)
+{
+  xcb_discard_reply (XGetXCBConnection (gdk_x11_get_default_xdisplay ()), cookie);
+}
+
+/**
+ * gdk_window_get_functions:
+ * @window: The toplevel #X11Window to get the functions for
+ * @functions: The window functions will be written here
+ *
+ * Returns the functions set on the GdkWindow with #gdk_window_set_functions
+ * Returns: TRUE if the window has functions set, FALSE otherwise.
+ **/
+gboolean
+egg_xid_get_functions (Window window,
+                       GdkWMFunction *functions)
+{
+  return egg_xid_reply_functions (egg_xid_request_functions (window), functions);
+}
@@ -1 +1,7 @@
+typedef unsigned int EggFunctionsCookie;
+
 gboolean egg_xid_get_functions (Window window, GdkWMFunction *functions);
+
+EggFunctionsCookie egg_xid_request_functions (Window window);
+gboolean egg_xid_reply_functions (EggFunctionsCookie cookie, GdkWMFunction *functions);
+void egg_xid_discard_functions (EggFunctionsCookie cookie);
@@ -24,11 +24,15 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #endif
 
-#include <stdlib.h> /* exit() */
+#include <stdlib.h> /* exit(), free() */
+#include <unistd.h> /* getuid() */
 
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <gdk/gdkx.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 
 #include <libindicator/indicator.h>
 #include <libindicator/indicator-object.h>
@@ -74,6 +78,79 @@ enum _ActiveStubsState {
 	STUBS_HIDE
 };
 
+typedef struct _RegistryChange RegistryChange;
+struct _RegistryChange {
+	guint generation;
+	guint xid;
+	gboolean added;
+};
+
+typedef struct _RegistryClient RegistryClient;
+struct _RegistryClient {
+	IndicatorAppmenu * iapp;
+	gchar * name;
+	guint watch_id;
+	GHashTable * windows;
+
+	/* Registration rate limiting */
+	gdouble tokens;
+	gint64 last_refill;
+	guint accepted;
+	guint rejected;
+
+	/* Wants the per-window signals sent to it */
+	gboolean legacy_signals;
+};
+
+typedef struct _WindowRecord WindowRecord;
+struct _WindowRecord {
+	guint xid;
+	WindowMenu * menus;
+
+	/* What BAMF knows about the window, NULL until it tells us */
+	BamfWindow * window;
+	BamfWindow * transient;
+	BamfApplication * app;
+	gboolean desktop;
+
+	/* The window whose menus are shown for this one, zero if there
+	   aren't any.  Only good while owner_generation is current. */
+	guint owner;
+	guint owner_generation;
+
+	/* Whether we've found the window has no GMenuModel properties,
+	   and whether we're watching its properties change */
+	gboolean probed;
+	gboolean watched;
+
+	/* The MWM functions, fetched when the window is focused.  They're
+	   only known while we're watching for them to change. */
+	EggFunctionsCookie functions_cookie;
+	gboolean functions_pending;
+	GdkWMFunction functions;
+	gboolean functions_known;
+
+	/* The show-now state last passed up for the menus' entries, and
+	   the entries' serial when it was */
+	gboolean show_now;
+	guint show_now_serial;
+	gboolean show_now_known;
+};
+
+/* Where an entry is in the list of all of the entries */
+typedef struct _AggregateEntry AggregateEntry;
+struct _AggregateEntry {
+	WindowMenu * menus;
+	GList * link;
+};
+
+typedef struct _RegistryRestore RegistryRestore;
+struct _RegistryRestore {
+	IndicatorAppmenu * iapp;
+	GVariant * menus;
+	gchar * sender;
+};
+
 typedef enum _AppmenuMode AppmenuMode;
 enum _AppmenuMode {
 	MODE_STANDARD,
@@ -91,21 +168,97 @@ struct _IndicatorAppmenu {
 	AppmenuMode mode;
 
 	WindowMenu * default_app;
-	GHashTable * apps;
+
+	/* Everything we know about each window, by XID */
+	GHashTable * windows;
 
 	BamfMatcher * matcher;
 	BamfWindow * active_window;
+	guint32 active_xid;
 	ActiveStubsState active_stubs;
 
 	GtkMenuItem * close_item;
 	GArray * window_menus;
 
-	GHashTable * desktop_windows;
+	GQueue * desktop_records;
 	WindowMenu * desktop_menu;
 
+	/* All menus mode shows the entries of every window, these
+	   are all of them and the window each is from */
+	GQueue * all_entries;
+	GHashTable * entry_index;
+
 	GDBusConnection * bus;
 	guint owner_id;
 	guint dbus_registration;
+
+	/* The applications that have registered windows, by unique name */
+	GHashTable * clients;
+
+	GSettings * settings;
+	guint registration_burst;
+	guint registration_rate;
+	gboolean warm_up;
+	gboolean broadcast_legacy;
+	guint realized_budget;
+	guint pinned_apps;
+	guint predicted_windows;
+
+	/* Private socket for clients that skip the bus */
+	GDBusServer * peer_server;
+	GHashTable * peers;
+
+	/* Changes to the set of windows, for GetMenusSince */
+	guint generation;
+	guint changes_base;
+	GArray * changes;
+	GVariant * unchanged_reply;
+	GVariant * menus_snapshot;
+
+	/* Changes that haven't been signaled yet */
+	guint signaled_generation;
+	guint windows_changed;
+
+	/* Writing the registered windows out for the next instance */
+	guint snapshot_save;
+	GCancellable * snapshot_cancel;
+	gboolean snapshot_saved;
+
+	/* Realized menus, most recently used first, and how often each
+	   application's menus have been shown */
+	GQueue * realized;
+	GHashTable * realized_links;
+	GHashTable * menu_apps;
+	GHashTable * app_activations;
+
+	/* Focused windows, most recent first, and the ones we think
+	   are going to be focused next */
+	GQueue * mru_xids;
+	GQueue * predicted;
+	guint predict_idle;
+
+	/* Registered windows waiting to have their menus built */
+	GQueue * warm_up_queue;
+	guint warm_up_idle;
+
+	/* Bumped whenever a cached menu owner might be wrong */
+	guint owner_generation;
+	guint close_item_idle;
+
+	/* Coalesced re-evaluation of the active window */
+	guint focus_update;
+	guint focus_update_requests;
+	guint focus_updates;
+
+	/* The windows that were open when we started, looked at a
+	   slice at a time */
+	GList * scan_windows;
+	GList * scan_next;
+	guint scan_idle;
+	gint64 scan_started;
+	guint scan_total;
+	guint scan_scanned;
+	guint scan_slices;
 };
 
 
@@ -167,6 +320,11 @@ static void window_entry_added                                       (WindowMenu
 static void window_entry_removed                                     (WindowMenu * mw,
                                                                       IndicatorObjectEntry * entry,
                                                                       IndicatorAppmenu * iapp);
+static void window_entry_moved                                       (WindowMenu * mw,
+                                                                      IndicatorObjectEntry * entry,
+                                                                      guint old_position,
+                                                                      guint new_position,
+                                                                      IndicatorAppmenu * iapp);
 static void window_status_changed                                    (WindowMenu * mw,
                                                                       DbusmenuStatus status,
                                                                       IndicatorAppmenu * iapp);
@@ -204,12 +362,69 @@ static GVariant * unregister_window                                  (IndicatorA
                                                                       guint windowid);
 static void connect_to_menu_signals                                  (IndicatorAppmenu * iapp,
 	                                                                  WindowMenu * menus);
+static void queue_focus_update                                       (IndicatorAppmenu * iapp);
+static void menus_used                                               (IndicatorAppmenu * iapp,
+                                                                      WindowMenu * wm);
+static void menus_evict                                              (IndicatorAppmenu * iapp);
+static GdkFilterReturn window_filter                                 (GdkXEvent * xevent,
+                                                                      GdkEvent * event,
+                                                                      gpointer user_data);
+static GdkFilterReturn root_filter                                   (GdkXEvent * xevent,
+                                                                      GdkEvent * event,
+                                                                      gpointer user_data);
+static void windows_changed_flush                                    (IndicatorAppmenu * iapp);
+static gboolean windows_changed_idle                                 (gpointer user_data);
+static void registry_client_free                                     (gpointer data);
+static void window_record_free                                       (gpointer data);
+static GVariant * bus_get_property                                   (GDBusConnection * connection,
+                                                                      const gchar * sender,
+                                                                      const gchar * object_path,
+                                                                      const gchar * interface,
+                                                                      const gchar * property,
+                                                                      GError ** error,
+                                                                      gpointer user_data);
+static void peer_server_start                                        (IndicatorAppmenu * iapp);
+static void peer_server_stop                                         (IndicatorAppmenu * iapp);
+static void registry_snapshot_restore                                (IndicatorAppmenu * iapp);
+static void registry_snapshot_remove                                 (IndicatorAppmenu * iapp);
+static void settings_changed                                         (GSettings * settings,
+                                                                      const gchar * key,
+                                                                      gpointer user_data);
+
+#define SETTINGS_SCHEMA  "com.canonical.indicator.appmenu"
+
+#define PEER_SOCKET_NAME  "indicator-appmenu-registrar"
+
+/* Where we keep the registered windows for the next instance, and
+   how long we let changes pile up before writing them out */
+#define REGISTRY_SNAPSHOT_NAME     "indicator-appmenu-registry"
+#define REGISTRY_SNAPSHOT_SECONDS  2
+
+#define DEFAULT_REGISTRATION_BURST  20
+#define DEFAULT_REGISTRATION_RATE   5
+
+#define DEFAULT_REALIZED_MENU_BUDGET  16
+#define DEFAULT_PINNED_APPLICATIONS   3
+#define DEFAULT_PREDICTED_WINDOWS     2
+
+/* How many focused windows we remember */
+#define MAX_MRU_WINDOWS  32
+
+/* How many registry changes we remember for GetMenusSince, clients
+   that are further behind than this get the whole list again */
+#define MAX_REGISTRY_CHANGES  256
+
+/* How long we spend looking at the windows that were open at
+   startup before letting everything else have a go */
+#define SCAN_SLICE_USEC  4000
 
 /* Unique error codes for debug interface */
 enum {
 	ERROR_NO_APPLICATIONS,
 	ERROR_NO_DEFAULT_APP,
-	ERROR_WINDOW_NOT_FOUND
+	ERROR_WINDOW_NOT_FOUND,
+	ERROR_RATE_LIMITED,
+	ERROR_NO_SENDER
 };
 
 /**********************
@@ -219,8 +434,8 @@ static GDBusNodeInfo *      node_info = NULL;
 static GDBusInterfaceInfo * interface_info = NULL;
 static GDBusInterfaceVTable interface_table = {
        method_call:    bus_method_call,
-       get_property:   NULL, /* No properties */
-       set_property:   NULL  /* No properties */
+       get_property:   bus_get_property,
+       set_property:   NULL  /* PeerAddress is read only */
 };
 
 G_DEFINE_TYPE (IndicatorAppmenu, indicator_appmenu, INDICATOR_OBJECT_TYPE);
@@ -267,12 +482,41 @@ indicator_appmenu_class_init (IndicatorAppmenuClass *klass)
 static void
 indicator_appmenu_init (IndicatorAppmenu *self)
 {
-	self->apps = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	self->windows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, window_record_free);
 	self->mode = MODE_STANDARD;
 	self->active_stubs = STUBS_UNKNOWN;
 
-	/* Setup the cache of windows with possible desktop entries */
-	self->desktop_windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	/* The windows that could have desktop menus */
+	self->desktop_records = g_queue_new();
+
+	self->all_entries = g_queue_new();
+	self->entry_index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	/* Generation zero is never valid so that new clients always
+	   get the full list */
+	self->generation = 1;
+	self->changes_base = self->generation;
+	self->signaled_generation = self->generation;
+	self->changes = g_array_new(FALSE, FALSE, sizeof(RegistryChange));
+
+	/* Connections to our private socket */
+	self->peers = g_hash_table_new_full(g_direct_hash, g_direct_equal, g_object_unref, NULL);
+
+	/* Applications that we're watching to drop off the bus */
+	self->clients = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, registry_client_free);
+
+	self->warm_up_queue = g_queue_new();
+
+	self->mru_xids = g_queue_new();
+	self->predicted = g_queue_new();
+
+	self->realized = g_queue_new();
+	self->realized_links = g_hash_table_new(g_direct_hash, g_direct_equal);
+	self->menu_apps = g_hash_table_new(g_direct_hash, g_direct_equal);
+	self->app_activations = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* Records start out with generation zero, so nothing's cached */
+	self->owner_generation = 1;
 
 	g_idle_add((GSourceFunc) indicator_appmenu_delayed_init, self);
 }
@@ -290,6 +534,24 @@ indicator_appmenu_delayed_init (IndicatorAppmenu *self)
 	if (self->mode != MODE_STANDARD)
 		self->active_stubs = STUBS_HIDE;
 
+	/* Don't abort if the schema isn't installed, we've got defaults */
+	GSettingsSchemaSource * source = g_settings_schema_source_get_default();
+	GSettingsSchema * schema = NULL;
+
+	if (source != NULL) {
+		schema = g_settings_schema_source_lookup(source, SETTINGS_SCHEMA, TRUE);
+	}
+
+	if (schema != NULL) {
+		self->settings = g_settings_new_full(schema, NULL, NULL);
+		g_signal_connect(self->settings, "changed", G_CALLBACK(settings_changed), self);
+		g_settings_schema_unref(schema);
+	} else {
+		g_warning("Unable to find settings schema '" SETTINGS_SCHEMA "', using defaults");
+	}
+
+	settings_changed(self->settings, NULL, self);
+
 	if (self->active_stubs != STUBS_HIDE)
 		build_window_menus(self);
 
@@ -309,6 +571,17 @@ indicator_appmenu_delayed_init (IndicatorAppmenu *self)
 
 	find_relevant_windows(self);
 
+	/* Catch windows getting their GMenuModel properties late */
+	gdk_window_add_filter(NULL, window_filter, self);
+
+	/* Watch for workspace switches so we can get the menus of the
+	   windows there ready, they're all shown at once otherwise */
+	if (self->mode != MODE_UNITY_ALL_MENUS) {
+		GdkWindow * root = gdk_get_default_root_window();
+		gdk_window_set_events(root, gdk_window_get_events(root) | GDK_PROPERTY_CHANGE_MASK);
+		gdk_window_add_filter(root, root_filter, self);
+	}
+
 	/* Request a name so others can find us */
 	self->owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
 	                                 DBUS_NAME,
@@ -349,6 +622,10 @@ on_bus_acquired (GDBusConnection * connection, const gchar * name,
 		g_critical("Unable to register the object to DBus: %s", error->message);
 		g_error_free(error);
 	}
+
+	/* If we've been restarted pick up the windows the last
+	   instance had instead of waiting for them to come back */
+	registry_snapshot_restore(iapp);
 }
 
 static void
@@ -369,12 +646,266 @@ on_name_lost (GDBusConnection * connection, const gchar * name,
 	switch_default_app(iapp, NULL, NULL);
 }
 
+/* Pick up the values of our settings, or the defaults if
+   we don't have any */
+static void
+settings_changed (GSettings * settings, const gchar * key, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	if (settings == NULL) {
+		iapp->registration_burst = DEFAULT_REGISTRATION_BURST;
+		iapp->registration_rate = DEFAULT_REGISTRATION_RATE;
+		iapp->warm_up = FALSE;
+		iapp->broadcast_legacy = TRUE;
+		iapp->realized_budget = DEFAULT_REALIZED_MENU_BUDGET;
+		iapp->pinned_apps = DEFAULT_PINNED_APPLICATIONS;
+		iapp->predicted_windows = DEFAULT_PREDICTED_WINDOWS;
+		return;
+	}
+
+	iapp->registration_burst = g_settings_get_uint(settings, "registration-burst");
+	iapp->registration_rate = g_settings_get_uint(settings, "registration-rate");
+	iapp->warm_up = g_settings_get_boolean(settings, "warm-up-menus");
+	iapp->broadcast_legacy = g_settings_get_boolean(settings, "broadcast-legacy-signals");
+	iapp->realized_budget = g_settings_get_uint(settings, "realized-menu-budget");
+	iapp->pinned_apps = g_settings_get_uint(settings, "pinned-applications");
+	iapp->predicted_windows = g_settings_get_uint(settings, "predicted-windows");
+
+	menus_evict(iapp);
+
+	if (g_settings_get_boolean(settings, "peer-to-peer")) {
+		peer_server_start(iapp);
+	} else {
+		peer_server_stop(iapp);
+	}
+}
+
+/* Only let the user we're running for talk to us directly */
+static gboolean
+peer_authorize (GDBusAuthObserver * observer, GIOStream * stream,
+                GCredentials * credentials, gpointer user_data)
+{
+	if (credentials == NULL) {
+		return FALSE;
+	}
+
+	return g_credentials_get_unix_user(credentials, NULL) == getuid();
+}
+
+/* Stop serving a peer connection */
+static void
+peer_remove (IndicatorAppmenu * iapp, GDBusConnection * connection)
+{
+	guint registration = GPOINTER_TO_UINT(g_hash_table_lookup(iapp->peers, connection));
+
+	if (registration != 0) {
+		g_dbus_connection_unregister_object(connection, registration);
+	}
+
+	g_signal_handlers_disconnect_by_data(connection, iapp);
+	g_hash_table_remove(iapp->peers, connection);
+}
+
+/* A peer has gone away */
+static void
+peer_closed (GDBusConnection * connection, gboolean remote_peer_vanished,
+             GError * error, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	g_debug("Peer connection closed");
+	peer_remove(iapp, connection);
+}
+
+/* A client connected to our private socket, give it the same
+   object that we have on the bus */
+static gboolean
+peer_new_connection (GDBusServer * server, GDBusConnection * connection, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	GError * error = NULL;
+
+	guint registration = g_dbus_connection_register_object(connection,
+	                                                       REG_OBJECT,
+	                                                       interface_info,
+	                                                       &interface_table,
+	                                                       iapp,
+	                                                       NULL,
+	                                                       &error);
+
+	if (error != NULL) {
+		g_warning("Unable to register the object on a peer connection: %s", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	g_debug("New peer connection");
+
+	g_hash_table_insert(iapp->peers, g_object_ref(connection), GUINT_TO_POINTER(registration));
+	g_signal_connect(connection, "closed", G_CALLBACK(peer_closed), iapp);
+
+	return TRUE;
+}
+
+/* Tell the folks on the bus where they can find us now */
+static void
+peer_address_changed (IndicatorAppmenu * iapp)
+{
+	if (iapp->bus == NULL) {
+		return;
+	}
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "PeerAddress",
+	                      bus_get_property(iapp->bus, NULL, REG_OBJECT, REG_IFACE, "PeerAddress", NULL, iapp));
+
+	g_dbus_connection_emit_signal(iapp->bus,
+	                              NULL,
+	                              REG_OBJECT,
+	                              "org.freedesktop.DBus.Properties",
+	                              "PropertiesChanged",
+	                              g_variant_new("(sa{sv}as)", REG_IFACE, &builder, NULL),
+	                              NULL);
+}
+
+/* Each instance gets its own socket, so a second one can't take it
+   away from the one that's running.  Clients find it through the
+   PeerAddress property rather than by name. */
+static gchar *
+peer_socket_path (void)
+{
+	gchar * name = g_strdup_printf("%s-%d", PEER_SOCKET_NAME, (gint)getpid());
+	gchar * path = g_build_filename(g_get_user_runtime_dir(), name, NULL);
+
+	g_free(name);
+
+	return path;
+}
+
+/* Start listening on the private socket */
+static void
+peer_server_start (IndicatorAppmenu * iapp)
+{
+	if (iapp->peer_server != NULL) {
+		return;
+	}
+
+	GError * error = NULL;
+	gchar * path = peer_socket_path();
+	gchar * address = g_strdup_printf("unix:path=%s", path);
+	gchar * guid = g_dbus_generate_guid();
+	GDBusAuthObserver * observer = g_dbus_auth_observer_new();
+
+	g_signal_connect(observer, "authorize-authenticated-peer", G_CALLBACK(peer_authorize), iapp);
+
+	/* The name is ours alone, so anything there was left behind by
+	   a crashed process that had our ID before */
+	g_unlink(path);
+
+	iapp->peer_server = g_dbus_server_new_sync(address,
+	                                           G_DBUS_SERVER_FLAGS_NONE,
+	                                           guid,
+	                                           observer,
+	                                           NULL,
+	                                           &error);
+
+	if (error != NULL) {
+		g_warning("Unable to listen on '%s': %s", address, error->message);
+		g_error_free(error);
+	} else {
+		g_signal_connect(iapp->peer_server, "new-connection", G_CALLBACK(peer_new_connection), iapp);
+		g_dbus_server_start(iapp->peer_server);
+		g_debug("Listening for peers on: %s", g_dbus_server_get_client_address(iapp->peer_server));
+
+		peer_address_changed(iapp);
+	}
+
+	g_object_unref(observer);
+	g_free(guid);
+	g_free(address);
+	g_free(path);
+}
+
+/* Stop listening on the private socket and drop everyone that
+   was connected to it */
+static void
+peer_server_stop (IndicatorAppmenu * iapp)
+{
+	if (iapp->peer_server == NULL) {
+		return;
+	}
+
+	GList * peers = g_hash_table_get_keys(iapp->peers);
+	GList * lpeer;
+
+	for (lpeer = peers; lpeer != NULL; lpeer = g_list_next(lpeer)) {
+		GDBusConnection * connection = G_DBUS_CONNECTION(lpeer->data);
+		g_dbus_connection_close(connection, NULL, NULL, NULL);
+		peer_remove(iapp, connection);
+	}
+
+	g_list_free(peers);
+
+	g_signal_handlers_disconnect_by_data(iapp->peer_server, iapp);
+	g_dbus_server_stop(iapp->peer_server);
+	g_clear_object(&iapp->peer_server);
+
+	gchar * path = peer_socket_path();
+	g_unlink(path);
+	g_free(path);
+
+	peer_address_changed(iapp);
+}
+
 /* Object refs decrement */
 static void
 indicator_appmenu_dispose (GObject *object)
 {
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(object);
 
+	if (iapp->focus_update != 0) {
+		g_source_remove(iapp->focus_update);
+		iapp->focus_update = 0;
+	}
+
+	if (iapp->windows_changed != 0) {
+		g_source_remove(iapp->windows_changed);
+		iapp->windows_changed = 0;
+	}
+
+	/* We're going away cleanly, nothing for the next instance to
+	   pick up */
+	registry_snapshot_remove(iapp);
+
+	if (iapp->warm_up_idle != 0) {
+		g_source_remove(iapp->warm_up_idle);
+		iapp->warm_up_idle = 0;
+	}
+
+	if (iapp->predict_idle != 0) {
+		g_source_remove(iapp->predict_idle);
+		iapp->predict_idle = 0;
+	}
+
+	if (iapp->scan_idle != 0) {
+		g_source_remove(iapp->scan_idle);
+		iapp->scan_idle = 0;
+	}
+
+	if (iapp->close_item_idle != 0) {
+		g_source_remove(iapp->close_item_idle);
+		iapp->close_item_idle = 0;
+	}
+
+	g_list_free_full(iapp->scan_windows, g_object_unref);
+	iapp->scan_windows = NULL;
+	iapp->scan_next = NULL;
+
+	gdk_window_remove_filter(gdk_get_default_root_window(), root_filter, iapp);
+	gdk_window_remove_filter(NULL, window_filter, iapp);
+
 	if (iapp->dbus_registration != 0) {
 		g_dbus_connection_unregister_object(iapp->bus, iapp->dbus_registration);
 		/* Don't care if it fails, there's nothing we can do */
@@ -395,8 +926,23 @@ indicator_appmenu_dispose (GObject *object)
 	/* No specific ref */
 	switch_default_app(iapp, NULL, NULL);
 
-	g_clear_pointer(&iapp->apps, g_hash_table_destroy);
-	g_clear_pointer(&iapp->desktop_windows, g_hash_table_destroy);
+	if (iapp->settings != NULL) {
+		g_signal_handlers_disconnect_by_data(iapp->settings, iapp);
+		g_clear_object(&iapp->settings);
+	}
+
+	if (iapp->peers != NULL) {
+		peer_server_stop(iapp);
+		g_clear_pointer(&iapp->peers, g_hash_table_destroy);
+	}
+
+	g_clear_pointer(&iapp->clients, g_hash_table_destroy);
+	/* The menus signal their entries going as they're freed, so the
+	   index has to outlive them */
+	g_clear_pointer(&iapp->windows, g_hash_table_destroy);
+	g_clear_pointer(&iapp->desktop_records, g_queue_free);
+	g_clear_pointer(&iapp->entry_index, g_hash_table_destroy);
+	g_clear_pointer(&iapp->all_entries, g_queue_free);
 
 	if (iapp->desktop_menu != NULL) {
 		/* Wait, nothing here?  Yup.  We're not referencing the
@@ -427,6 +973,17 @@ indicator_appmenu_finalize (GObject *object)
 		g_array_free(iapp->window_menus, TRUE);
 	}
 
+	g_array_free(iapp->changes, TRUE);
+	g_queue_free(iapp->warm_up_queue);
+	g_queue_free(iapp->mru_xids);
+	g_queue_free(iapp->predicted);
+	g_queue_free(iapp->realized);
+	g_hash_table_destroy(iapp->realized_links);
+	g_hash_table_destroy(iapp->menu_apps);
+	g_hash_table_destroy(iapp->app_activations);
+	g_clear_pointer(&iapp->unchanged_reply, g_variant_unref);
+	g_clear_pointer(&iapp->menus_snapshot, g_variant_unref);
+
 	g_signal_handlers_disconnect_by_data(iapp->matcher, iapp);
 
 	G_OBJECT_CLASS (indicator_appmenu_parent_class)->finalize (object);
@@ -437,24 +994,82 @@ static void
 emit_signal (IndicatorAppmenu * iapp, const gchar * name, GVariant * variant)
 {
 	GError * error = NULL;
+	GHashTableIter peer_iter;
+	gpointer peer;
+
+	/* We may be sending this to more than one connection */
+	g_variant_ref_sink(variant);
+
+	/* The peers can be served before we're on the bus, and they
+	   still want it if the bus couldn't take it */
+	if (iapp->bus != NULL) {
+		g_dbus_connection_emit_signal (iapp->bus,
+			                       NULL,
+			                       REG_OBJECT,
+			                       REG_IFACE,
+			                       name,
+			                       variant,
+			                       &error);
 
-	g_dbus_connection_emit_signal (iapp->bus,
-		                       NULL,
-		                       REG_OBJECT,
-		                       REG_IFACE,
-		                       name,
-		                       variant,
-		                       &error);
+		if (error != NULL) {
+			g_critical("Unable to send %s signal: %s", name, error->message);
+			g_error_free(error);
+		}
+	}
 
-	if (error != NULL) {
-		g_critical("Unable to send %s signal: %s", name, error->message);
-		g_error_free(error);
-		return;
+	g_hash_table_iter_init(&peer_iter, iapp->peers);
+	while (g_hash_table_iter_next(&peer_iter, &peer, NULL)) {
+		g_dbus_connection_emit_signal(G_DBUS_CONNECTION(peer),
+		                              NULL,
+		                              REG_OBJECT,
+		                              REG_IFACE,
+		                              name,
+		                              variant,
+		                              NULL);
 	}
 
+	g_variant_unref(variant);
+
 	return;
 }
 
+/* Send one of the per-window signals.  Unless the settings say
+   otherwise everyone gets them like they always have, else only the
+   clients that have asked for them do and everyone else just gets
+   WindowsChanged */
+static void
+emit_legacy_signal (IndicatorAppmenu * iapp, const gchar * name, GVariant * variant)
+{
+	GHashTableIter client_iter;
+	gpointer value;
+
+	if (iapp->broadcast_legacy) {
+		emit_signal(iapp, name, variant);
+		return;
+	}
+
+	g_variant_ref_sink(variant);
+
+	g_hash_table_iter_init(&client_iter, iapp->clients);
+	while (g_hash_table_iter_next(&client_iter, NULL, &value)) {
+		RegistryClient * client = (RegistryClient *)value;
+
+		if (!client->legacy_signals) {
+			continue;
+		}
+
+		g_dbus_connection_emit_signal(iapp->bus,
+		                              client->name,
+		                              REG_OBJECT,
+		                              REG_IFACE,
+		                              name,
+		                              variant,
+		                              NULL);
+	}
+
+	g_variant_unref(variant);
+}
+
 /* Close the current application using magic */
 static void
 close_current (GtkMenuItem * mi, gpointer user_data)
@@ -544,104 +1159,369 @@ G_GNUC_END_IGNORE_DEPRECATIONS
 static void
 determine_new_desktop (IndicatorAppmenu * iapp)
 {
-	GList * keys = g_hash_table_get_keys(iapp->desktop_windows);
-	GList * key;
-
-	for (key = keys; key != NULL; key = g_list_next(key)) {
-		guint xid = GPOINTER_TO_UINT(key->data);
-		gpointer pwm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
-		if (pwm != NULL) {
-			g_debug("Setting Desktop Menus to: %X", xid);
-			iapp->desktop_menu = WINDOW_MENU(pwm);
+	GList * link;
+
+	/* There's only ever one or two desktop windows */
+	for (link = iapp->desktop_records->head; link != NULL; link = g_list_next(link)) {
+		WindowRecord * record = (WindowRecord *)link->data;
+		if (record->menus != NULL) {
+			g_debug("Setting Desktop Menus to: %X", record->xid);
+			iapp->desktop_menu = record->menus;
+			menus_used(iapp, iapp->desktop_menu);
 			break;
 		}
 	}
 
-	g_list_free(keys);
-
 	return;
 }
 
-/* Puts all the windows we care about into the hash table so that we
-   can have a nice list of them. */
-static void
-find_relevant_windows (IndicatorAppmenu * iapp)
+/* Look up what we know about a window */
+static WindowRecord *
+window_record_get (IndicatorAppmenu * iapp, guint xid)
 {
-	GList * windows = bamf_matcher_get_windows(iapp->matcher);
-	GList * lwindow;
+	return g_hash_table_lookup(iapp->windows, GUINT_TO_POINTER(xid));
+}
 
-	for (lwindow = windows; lwindow != NULL; lwindow = g_list_next(lwindow)) {
-		BamfView * view = BAMF_VIEW(lwindow->data);
-		new_window(iapp->matcher, view, iapp);
+/* Look up the menus for a window, if we have them */
+static WindowMenu *
+window_record_get_menus (IndicatorAppmenu * iapp, guint xid)
+{
+	WindowRecord * record = window_record_get(iapp, xid);
+	return record != NULL ? record->menus : NULL;
+}
+
+/* Get the record for a window, making a new one if it's the first
+   we've heard of it.  Windows can register before BAMF finds them. */
+static WindowRecord *
+window_record_ensure (IndicatorAppmenu * iapp, guint xid)
+{
+	WindowRecord * record = window_record_get(iapp, xid);
+
+	if (record == NULL) {
+		record = g_new0(WindowRecord, 1);
+		record->xid = xid;
+		g_hash_table_insert(iapp->windows, GUINT_TO_POINTER(xid), record);
 	}
 
-	g_list_free(windows);
+	return record;
+}
 
-	return;
+/* Drop the BAMF side of the record */
+static void
+window_record_clear_window (WindowRecord * record)
+{
+	g_clear_object(&record->window);
+	g_clear_object(&record->transient);
+	g_clear_object(&record->app);
 }
 
-/* When new windows are born, we check to see if they're desktop
-   windows. */
 static void
-new_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
+window_record_free (gpointer data)
 {
-	if (!BAMF_IS_WINDOW(view)) {
-		return;
+	WindowRecord * record = (WindowRecord *)data;
+
+	window_record_clear_window(record);
+	g_clear_object(&record->menus);
+
+	if (record->functions_pending) {
+		egg_xid_discard_functions(record->functions_cookie);
 	}
 
-	BamfWindow * window = BAMF_WINDOW(view);
-	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
-	guint32 xid = bamf_window_get_xid(window);
+	g_free(record);
+}
 
-	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		ensure_menus(iapp, window);
+/* Throw away the record if there's nothing left in it */
+static void
+window_record_release (IndicatorAppmenu * iapp, WindowRecord * record)
+{
+	if (record->menus != NULL || record->window != NULL) {
 		return;
 	}
 
-	if (bamf_window_get_window_type(window) != BAMF_WINDOW_DESKTOP) {
-		return;
+	if (record->desktop) {
+		g_queue_remove(iapp->desktop_records, record);
 	}
 
-	g_hash_table_insert(iapp->desktop_windows, GUINT_TO_POINTER(xid), GINT_TO_POINTER(TRUE));
+	g_hash_table_remove(iapp->windows, GUINT_TO_POINTER(record->xid));
+}
 
-	g_debug("New Desktop Window: %X", xid);
+/* Forget which windows own the menus of which other windows, all of
+   them, since we don't know whose chain of parents was affected */
+static void
+owners_invalidate (IndicatorAppmenu * iapp)
+{
+	iapp->owner_generation++;
 
-	gpointer pwm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
-	if (pwm != NULL) {
-		WindowMenu * wm = WINDOW_MENU(pwm);
-		iapp->desktop_menu = wm;
-		g_debug("Setting Desktop Menus to: %X", xid);
-		if (iapp->active_window == NULL && iapp->default_app == NULL) {
-			switch_default_app(iapp, NULL, NULL);
-		}
+	/* Zero is for records that have never been resolved */
+	if (iapp->owner_generation == 0) {
+		iapp->owner_generation++;
 	}
 }
 
-/* When windows leave us, this function gets called */
+/* Only have the X server tell us about property changes on the
+   windows we still need something from: the ones that may yet get
+   GMenuModel properties, the active one, and the ones whose MWM
+   functions we've got for the close item, so they stay good when the
+   window is focused again.  Windows that have never been focused
+   would just wake us up with their title changes and the like. */
 static void
-old_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
+window_record_update_watch (IndicatorAppmenu * iapp, WindowRecord * record)
 {
-	if (!BAMF_IS_WINDOW(view)) {
+	gboolean wanted = record->probed || record->functions_pending || record->functions_known ||
+	                  (iapp->mode != MODE_UNITY_ALL_MENUS &&
+	                   record->window != NULL && record->window == iapp->active_window);
+
+	if (record->watched == wanted) {
 		return;
 	}
 
-	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
-	BamfWindow * window = BAMF_WINDOW(view);
-	guint32 xid = bamf_window_get_xid(window);
+	gdk_error_trap_push();
+	XSelectInput(gdk_x11_get_default_xdisplay(), record->xid, wanted ? PropertyChangeMask : NoEventMask);
+	gdk_error_trap_pop_ignored();
 
-	unregister_window(iapp, xid);
+	record->watched = wanted;
+}
 
-	return;
+/* Send off for the window's MWM functions, we'll pick up the reply
+   when we need it */
+static void
+window_record_request_functions (IndicatorAppmenu * iapp, WindowRecord * record)
+{
+	if (record->functions_pending) {
+		egg_xid_discard_functions(record->functions_cookie);
+	}
+
+	/* Watch first so a change can't slip in between */
+	record->functions_pending = TRUE;
+	window_record_update_watch(iapp, record);
+
+	record->functions_cookie = egg_xid_request_functions(record->xid);
+	record->functions_known = FALSE;
 }
 
-/* List of desktop files that shouldn't have menu stubs. */
-const static gchar * stubs_blacklist[] = {
-	/* Firefox */
-	"/firefox.desktop",
-	/* Thunderbird */
-	"/thunderbird.desktop",
-	/* Open Office */
-	"/openoffice.org-base.desktop",
+/* Gets the window's MWM functions, only waiting on the X server if the
+   reply to our request hasn't come in yet */
+static GdkWMFunction
+window_record_get_functions (IndicatorAppmenu * iapp, WindowRecord * record)
+{
+	if (!record->functions_known) {
+		if (!record->functions_pending) {
+			window_record_request_functions(iapp, record);
+		}
+
+		if (!egg_xid_reply_functions(record->functions_cookie, &record->functions)) {
+			g_debug("Unable to get MWM functions for: %d", record->xid);
+			record->functions = GDK_FUNC_ALL;
+		}
+
+		record->functions_pending = FALSE;
+		record->functions_known = TRUE;
+		window_record_update_watch(iapp, record);
+	}
+
+	return record->functions;
+}
+
+/* Look at some more of the windows that were open at startup, until
+   we run out of them or time */
+static gboolean
+scan_windows_slice (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	gint64 deadline = g_get_monotonic_time() + SCAN_SLICE_USEC;
+
+	iapp->scan_slices++;
+
+	while (iapp->scan_next != NULL) {
+		BamfView * view = BAMF_VIEW(iapp->scan_next->data);
+		iapp->scan_next = g_list_next(iapp->scan_next);
+
+		/* Closed while we were waiting */
+		if (bamf_view_is_closed(view)) {
+			continue;
+		}
+
+		new_window(iapp->matcher, view, iapp);
+		iapp->scan_scanned++;
+
+		if (g_get_monotonic_time() >= deadline) {
+			break;
+		}
+	}
+
+	if (iapp->scan_next != NULL) {
+		g_debug("Startup scan: %u of %u windows after %u slices",
+		        iapp->scan_scanned, iapp->scan_total, iapp->scan_slices);
+
+		if (iapp->scan_idle == 0) {
+			iapp->scan_idle = g_idle_add(scan_windows_slice, iapp);
+		}
+
+		return G_SOURCE_CONTINUE;
+	}
+
+	g_debug("Startup scan: %u of %u windows in %u slices, took %" G_GINT64_FORMAT "ms",
+	        iapp->scan_scanned, iapp->scan_total, iapp->scan_slices,
+	        (g_get_monotonic_time() - iapp->scan_started) / 1000);
+
+	g_list_free_full(iapp->scan_windows, g_object_unref);
+	iapp->scan_windows = NULL;
+	iapp->scan_idle = 0;
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Look at the windows that are already open.  There can be a lot of
+   them after a restart, so they're done a slice at a time, starting
+   with the ones that matter right now: the active window and the
+   bottom of the stack, where the desktop lives.  Then the rest from
+   the top down. */
+static void
+find_relevant_windows (IndicatorAppmenu * iapp)
+{
+	if (iapp->matcher == NULL) {
+		return;
+	}
+
+	GList * windows = bamf_matcher_get_window_stack_for_monitor(iapp->matcher, -1);
+
+	if (windows != NULL) {
+		GList * bottom = windows;
+		windows = g_list_remove_link(windows, bottom);
+		windows = g_list_concat(bottom, g_list_reverse(windows));
+	}
+
+	BamfWindow * active = bamf_matcher_get_active_window(iapp->matcher);
+	GList * lactive = g_list_find(windows, active);
+
+	if (lactive != NULL) {
+		windows = g_list_remove_link(windows, lactive);
+		windows = g_list_concat(lactive, windows);
+	}
+
+	g_list_foreach(windows, (GFunc)g_object_ref, NULL);
+
+	iapp->scan_windows = windows;
+	iapp->scan_next = windows;
+	iapp->scan_total = g_list_length(windows);
+	iapp->scan_scanned = 0;
+	iapp->scan_slices = 0;
+	iapp->scan_started = g_get_monotonic_time();
+
+	/* The first slice right away, so the active window is ready */
+	scan_windows_slice(iapp);
+
+	return;
+}
+
+/* When new windows are born, we check to see if they're desktop
+   windows. */
+static void
+new_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
+{
+	if (!BAMF_IS_WINDOW(view)) {
+		return;
+	}
+
+	BamfWindow * window = BAMF_WINDOW(view);
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	guint32 xid = bamf_window_get_xid(window);
+
+	/* Grab everything we'll want to know about the window
+	   while we're here, so we don't have to ask BAMF later */
+	WindowRecord * record = window_record_ensure(iapp, xid);
+
+	if (record->window != window) {
+		window_record_clear_window(record);
+
+		record->probed = FALSE;
+		record->watched = FALSE;
+
+		record->window = g_object_ref(window);
+		record->transient = bamf_window_get_transient(window);
+		if (record->transient != NULL) {
+			g_object_ref(record->transient);
+		}
+		record->app = bamf_matcher_get_application_for_window(iapp->matcher, window);
+		if (record->app != NULL) {
+			g_object_ref(record->app);
+		}
+
+	}
+
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		ensure_menus(iapp, window);
+		return;
+	}
+
+	if (bamf_window_get_window_type(window) != BAMF_WINDOW_DESKTOP || record->desktop) {
+		return;
+	}
+
+	record->desktop = TRUE;
+	g_queue_push_tail(iapp->desktop_records, record);
+
+	g_debug("New Desktop Window: %X", xid);
+
+	if (record->menus != NULL) {
+		WindowMenu * wm = record->menus;
+		iapp->desktop_menu = wm;
+		menus_used(iapp, wm);
+		g_debug("Setting Desktop Menus to: %X", xid);
+		if (iapp->active_window == NULL && iapp->default_app == NULL) {
+			switch_default_app(iapp, NULL, NULL);
+		}
+	}
+}
+
+/* When windows leave us, this function gets called */
+static void
+old_window (BamfMatcher * matcher, BamfView * view, gpointer user_data)
+{
+	if (!BAMF_IS_WINDOW(view)) {
+		return;
+	}
+
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	BamfWindow * window = BAMF_WINDOW(view);
+	guint32 xid = bamf_window_get_xid(window);
+
+	g_queue_remove(iapp->mru_xids, GUINT_TO_POINTER(xid));
+	g_queue_remove(iapp->predicted, GUINT_TO_POINTER(xid));
+
+	WindowRecord * record = window_record_get(iapp, xid);
+	if (record == NULL) {
+		return;
+	}
+
+	if (record->desktop) {
+		g_queue_remove(iapp->desktop_records, record);
+		record->desktop = FALSE;
+	}
+
+	window_record_clear_window(record);
+
+	/* It may have been in the middle of someone's chain of parents */
+	owners_invalidate(iapp);
+
+	if (record->menus != NULL) {
+		/* Releases the record */
+		unregister_window(iapp, xid);
+	} else {
+		window_record_release(iapp, record);
+	}
+
+	return;
+}
+
+/* List of desktop files that shouldn't have menu stubs. */
+const static gchar * stubs_blacklist[] = {
+	/* Firefox */
+	"/firefox.desktop",
+	/* Thunderbird */
+	"/thunderbird.desktop",
+	/* Open Office */
+	"/openoffice.org-base.desktop",
 	"/openoffice.org-impress.desktop",
 	"/openoffice.org-calc.desktop",
 	"/openoffice.org-math.desktop",
@@ -686,18 +1566,10 @@ get_entries (IndicatorObject * io)
 {
 	g_return_val_if_fail(IS_INDICATOR_APPMENU(io), NULL);
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
-	GHashTableIter iter;
-	gpointer value;
 	GList* entries = NULL;
 
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		g_hash_table_iter_init(&iter, iapp->apps);
-		while (g_hash_table_iter_next(&iter, NULL, &value)) {
-			GList *app_entries = window_menu_get_entries(WINDOW_MENU (value));
-			entries = g_list_concat(app_entries, entries);
-		}
-
-		return entries;
+		return g_list_copy(iapp->all_entries->head);
 	}
 
 	/* If we have a focused app with menus, use it's windows */
@@ -754,18 +1626,14 @@ get_location (IndicatorObject * io, IndicatorObjectEntry * entry)
 	IndicatorAppmenu * iapp = INDICATOR_APPMENU(io);
 
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		GHashTableIter iter;
-		gpointer value;
+		AggregateEntry * aggregate = g_hash_table_lookup(iapp->entry_index, entry);
 
-		g_hash_table_iter_init(&iter, iapp->apps);
-		while (g_hash_table_iter_next(&iter, NULL, &value)) {
-			count = window_menu_get_location(WINDOW_MENU (value), entry);
+		if (aggregate == NULL)
+			return 0;
 
-			if (count != G_MAXUINT)
-				return count;
-		}
+		count = window_menu_get_location(aggregate->menus, entry);
 
-		return 0;
+		return (count == G_MAXUINT) ? 0 : count;
 	}
 
 	if (iapp->default_app != NULL) {
@@ -799,34 +1667,18 @@ entry_activate (IndicatorObject * io, IndicatorObjectEntry * entry, guint timest
 	return entry_activate_window(io, entry, 0, timestamp);
 }
 
-/* Find the BAMF Window that is associated with that XID.  Unfortunately
-   this requires a bit of searching, don't do it too often */
+/* Find the BAMF Window that is associated with that XID.  The record
+   has it for every window BAMF has told us about, otherwise BAMF can
+   look it up by XID itself */
 static BamfWindow *
 xid_to_bamf_window (IndicatorAppmenu * iapp, guint xid)
 {
-	BamfWindow * newwindow = bamf_matcher_get_window_for_xid(iapp->matcher, xid);
-
-	if (BAMF_IS_WINDOW(newwindow))
-		return newwindow;
-
-	BamfApplication *application = bamf_matcher_get_application_for_xid(iapp->matcher, xid);
-	GList * children = bamf_view_peek_children (BAMF_VIEW (application));
-	GList * l;
-
-	for (l = children; l; l = l->next) {
-		if (!BAMF_IS_WINDOW(l->data)) {
-			continue;
-		}
+	WindowRecord * record = window_record_get(iapp, xid);
 
-		BamfWindow * testwindow = BAMF_WINDOW(l->data);
+	if (record != NULL && record->window != NULL)
+		return record->window;
 
-		if (xid == bamf_window_get_xid(testwindow)) {
-			newwindow = testwindow;
-			break;
-		}
-	}
-
-	return newwindow;
+	return bamf_matcher_get_window_for_xid(iapp->matcher, xid);
 }
 
 /* Responds to a menuitem being activated on the panel. */
@@ -882,6 +1734,47 @@ window_finalized_is_active (gpointer user_data, GObject * old_window)
 	return;
 }
 
+/* The close item is only sensitive if the active window can be
+   closed, which we get from the cached MWM functions */
+static void
+update_close_item (IndicatorAppmenu * iapp)
+{
+	gtk_widget_set_sensitive(GTK_WIDGET(iapp->close_item), FALSE);
+
+	if (iapp->active_window == NULL) {
+		return;
+	}
+
+	guint32 xid = bamf_window_get_xid(iapp->active_window);
+	if (xid == 0 || bamf_view_is_closed (BAMF_VIEW (iapp->active_window))) {
+		return;
+	}
+
+	WindowRecord * record = window_record_ensure(iapp, xid);
+	GdkWMFunction functions = window_record_get_functions(iapp, record);
+
+	if (functions & GDK_FUNC_ALL || functions & GDK_FUNC_CLOSE) {
+		gtk_widget_set_sensitive(GTK_WIDGET(iapp->close_item), TRUE);
+	}
+
+	return;
+}
+
+/* Give the new hints time to arrive before looking at them */
+static gboolean
+close_item_idle (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	iapp->close_item_idle = 0;
+
+	if (iapp->close_item != NULL) {
+		update_close_item(iapp);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
 /* A helper for switch_default_app that takes care of the
    switching of the active window variable */
 static void
@@ -891,11 +1784,21 @@ switch_active_window (IndicatorAppmenu * iapp, BamfWindow * active_window)
 		return;
 	}
 
+	/* The old window may be gone, so only its XID can be trusted */
+	guint32 old_xid = iapp->active_xid;
+
 	if (iapp->active_window != NULL) {
 		g_object_weak_unref(G_OBJECT(iapp->active_window), window_finalized_is_active, iapp);
 	}
 
 	iapp->active_window = active_window;
+	iapp->active_xid = (active_window != NULL) ? bamf_window_get_xid(active_window) : 0;
+
+	/* It may not need watching now it's not the active one */
+	WindowRecord * old_record = window_record_get(iapp, old_xid);
+	if (old_record != NULL) {
+		window_record_update_watch(iapp, old_record);
+	}
 
 	if (iapp->mode == MODE_STANDARD)
 		iapp->active_stubs = STUBS_UNKNOWN;
@@ -912,26 +1815,7 @@ switch_active_window (IndicatorAppmenu * iapp, BamfWindow * active_window)
 		return;
 	}
 
-	gtk_widget_set_sensitive(GTK_WIDGET(iapp->close_item), FALSE);
-
-	if (iapp->active_window == NULL) {
-		return;
-	}
-
-	guint32 xid = bamf_window_get_xid(iapp->active_window);
-	if (xid == 0 || bamf_view_is_closed (BAMF_VIEW (iapp->active_window))) {
-		return;
-	}
-
-	GdkWMFunction functions;
-	if (!egg_xid_get_functions(xid, &functions)) {
-		g_debug("Unable to get MWM functions for: %d", xid);
-		functions = GDK_FUNC_ALL;
-	}
-
-	if (functions & GDK_FUNC_ALL || functions & GDK_FUNC_CLOSE) {
-		gtk_widget_set_sensitive(GTK_WIDGET(iapp->close_item), TRUE);
-	}
+	update_close_item(iapp);
 
 	return;
 }
@@ -950,6 +1834,10 @@ connect_to_menu_signals (IndicatorAppmenu * iapp, WindowMenu * menus)
 	                 WINDOW_MENU_SIGNAL_ENTRY_REMOVED,
 	                 G_CALLBACK(window_entry_removed),
 	                 iapp);
+	g_signal_connect(menus,
+	                 WINDOW_MENU_SIGNAL_ENTRY_MOVED,
+	                 G_CALLBACK(window_entry_moved),
+	                 iapp);
 	g_signal_connect(menus,
 	                 WINDOW_MENU_SIGNAL_STATUS_CHANGED,
 	                 G_CALLBACK(window_status_changed),
@@ -964,351 +1852,1631 @@ connect_to_menu_signals (IndicatorAppmenu * iapp, WindowMenu * menus)
 	                 iapp);
 }
 
-/* Switch applications, remove all the entires for the previous
-   one and add them for the new application */
-static void
-switch_default_app (IndicatorAppmenu * iapp, WindowMenu * newdef, BamfWindow * active_window)
+/* Whether the application these menus belong to is one of the
+   ones that gets used the most */
+static gboolean
+menus_pinned (IndicatorAppmenu * iapp, WindowMenu * wm)
 {
-	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		return;
+	const gchar * desktop = g_hash_table_lookup(iapp->menu_apps, wm);
+
+	if (desktop == NULL || iapp->pinned_apps == 0) {
+		return FALSE;
 	}
 
-	if (iapp->default_app == newdef && iapp->default_app != NULL) {
-		/* We've got an app with menus and it hasn't changed. */
+	guint count = GPOINTER_TO_UINT(g_hash_table_lookup(iapp->app_activations, desktop));
+	guint busier = 0;
+	GHashTableIter hash_iter;
+	gpointer value;
 
-		/* Keep active window up-to-date, though we're probably not
-		   using it much. */
-		switch_active_window(iapp, active_window);
-		return;
+	g_hash_table_iter_init(&hash_iter, iapp->app_activations);
+	while (g_hash_table_iter_next(&hash_iter, NULL, &value)) {
+		if (GPOINTER_TO_UINT(value) > count && ++busier >= iapp->pinned_apps) {
+			return FALSE;
+		}
 	}
 
-	if (iapp->default_app == NULL && iapp->active_window == active_window && newdef == NULL) {
-		/* There's no application menus, but the active window hasn't
-		   changed.  So there's no change. */
+	return TRUE;
+}
+
+/* Drop the least recently used menus until we're inside the budget,
+   leaving the ones that are showing and the popular ones alone */
+static void
+menus_evict (IndicatorAppmenu * iapp)
+{
+	if (iapp->realized_budget == 0) {
 		return;
 	}
 
-	/* hide the entries that we're swapping out */
-	indicator_object_set_visible (INDICATOR_OBJECT(iapp), FALSE);
+	GList * link = iapp->realized->tail;
 
-	if (iapp->default_app)
-	{
-		/* Disconnect signals */
-		g_signal_handlers_disconnect_by_data(iapp->default_app, iapp);
+	while (link != NULL && g_queue_get_length(iapp->realized) > iapp->realized_budget) {
+		GList * prev = link->prev;
+		WindowMenu * wm = WINDOW_MENU(link->data);
 
-		/* Default App is NULL, let's see if it needs replacement */
-		iapp->default_app = NULL;
+		if (wm != iapp->default_app && wm != iapp->desktop_menu && !menus_pinned(iapp, wm)) {
+			g_debug("Evicting menus for %X", window_menu_get_xid(wm));
+
+			g_hash_table_remove(iapp->realized_links, wm);
+			g_queue_delete_link(iapp->realized, link);
+			window_menu_unrealize(wm);
+		}
+
+		link = prev;
 	}
+}
 
-	/* Update the active window pointer -- may be NULL */
-	switch_active_window(iapp, active_window);
+/* Make sure the menus are built and put them at the front of
+   the line so that they're the last to go */
+static void
+menus_used (IndicatorAppmenu * iapp, WindowMenu * wm)
+{
+	window_menu_realize(wm);
 
-	/* If we're putting up a new window, let's do that now. */
-	if (newdef != NULL) {
-		/* Switch */
-		iapp->default_app = newdef;
-		connect_to_menu_signals(iapp, iapp->default_app);
+	/* Everything is always shown there */
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		return;
 	}
 
-	/* show the entries that we're swapping in */
-	indicator_object_set_visible (INDICATOR_OBJECT(iapp), TRUE);
+	GList * link = g_hash_table_lookup(iapp->realized_links, wm);
 
-	/* Set up initial state for new entries if needed */
-	if (iapp->default_app != NULL &&
-            window_menu_get_status (iapp->default_app) != WINDOW_MENU_STATUS_NORMAL) {
-		window_status_changed(iapp->default_app,
-		                      window_menu_get_status (iapp->default_app),
-		                      iapp);
+	if (link != NULL) {
+		g_queue_unlink(iapp->realized, link);
+		g_queue_push_head_link(iapp->realized, link);
+	} else {
+		g_queue_push_head(iapp->realized, wm);
+		g_hash_table_insert(iapp->realized_links, wm, iapp->realized->head);
 	}
 
-	return;
+	menus_evict(iapp);
 }
 
+/* The menus are going away, stop keeping track of them */
 static void
-track_menus (IndicatorAppmenu * iapp, guint xid, WindowMenu * menus)
+menus_forget (IndicatorAppmenu * iapp, WindowMenu * wm)
 {
-	g_return_if_fail(IS_WINDOW_MENU(menus));
+	GList * link = g_hash_table_lookup(iapp->realized_links, wm);
 
-	g_hash_table_insert(iapp->apps, GUINT_TO_POINTER(xid), menus);
+	if (link != NULL) {
+		g_hash_table_remove(iapp->realized_links, wm);
+		g_queue_delete_link(iapp->realized, link);
+	}
+
+	g_hash_table_remove(iapp->menu_apps, wm);
+}
+
+/* Count the menus being shown against their application so we know
+   which applications to keep the menus around for */
+static void
+count_activation (IndicatorAppmenu * iapp, WindowMenu * wm, BamfWindow * window)
+{
+	WindowRecord * record = window_record_get(iapp, bamf_window_get_xid(window));
+	BamfApplication * app = NULL;
+
+	if (record != NULL && record->window == window) {
+		app = record->app;
+	} else {
+		app = bamf_matcher_get_application_for_window(iapp->matcher, window);
+	}
+
+	if (app == NULL || bamf_application_get_desktop_file(app) == NULL) {
+		return;
+	}
+
+	const gchar * desktop = g_intern_string(bamf_application_get_desktop_file(app));
+	guint count = GPOINTER_TO_UINT(g_hash_table_lookup(iapp->app_activations, desktop));
+
+	g_hash_table_insert(iapp->app_activations, (gpointer)desktop, GUINT_TO_POINTER(count + 1));
+	g_hash_table_insert(iapp->menu_apps, wm, (gpointer)desktop);
+}
+
+/* Switch applications, remove all the entires for the previous
+   one and add them for the new application */
+static void
+switch_default_app (IndicatorAppmenu * iapp, WindowMenu * newdef, BamfWindow * active_window)
+{
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		return;
+	}
+
+	if (iapp->default_app == newdef && iapp->default_app != NULL) {
+		/* We've got an app with menus and it hasn't changed. */
+
+		/* Keep active window up-to-date, though we're probably not
+		   using it much. */
+		switch_active_window(iapp, active_window);
+		return;
+	}
+
+	if (iapp->default_app == NULL && iapp->active_window == active_window && newdef == NULL) {
+		/* There's no application menus, but the active window hasn't
+		   changed.  So there's no change. */
+		return;
+	}
+
+	/* Build the menus before we show them so that any entries
+	   that are already there come up with the rest */
+	if (newdef != NULL) {
+		if (active_window != NULL) {
+			count_activation(iapp, newdef, active_window);
+		}
+
+		menus_used(iapp, newdef);
+	}
+
+	/* hide the entries that we're swapping out */
+	indicator_object_set_visible (INDICATOR_OBJECT(iapp), FALSE);
+
+	if (iapp->default_app)
+	{
+		/* Disconnect signals */
+		g_signal_handlers_disconnect_by_data(iapp->default_app, iapp);
+
+		/* Default App is NULL, let's see if it needs replacement */
+		iapp->default_app = NULL;
+	}
+
+	/* Update the active window pointer -- may be NULL */
+	switch_active_window(iapp, active_window);
+
+	/* If we're putting up a new window, let's do that now. */
+	if (newdef != NULL) {
+		/* Switch */
+		iapp->default_app = newdef;
+		connect_to_menu_signals(iapp, iapp->default_app);
+	}
+
+	/* show the entries that we're swapping in */
+	indicator_object_set_visible (INDICATOR_OBJECT(iapp), TRUE);
+
+	/* The entries were all added again, so they've lost it */
+	if (iapp->default_app != NULL) {
+		WindowRecord * record = window_record_get(iapp, window_menu_get_xid(iapp->default_app));
+		if (record != NULL) {
+			record->show_now_known = FALSE;
+		}
+	}
+
+	/* Set up initial state for new entries if needed */
+	if (iapp->default_app != NULL &&
+            window_menu_get_status (iapp->default_app) != WINDOW_MENU_STATUS_NORMAL) {
+		window_status_changed(iapp->default_app,
+		                      window_menu_get_status (iapp->default_app),
+		                      iapp);
+	}
+
+	return;
+}
+
+/* Record that a window was added or removed from the set of windows
+   that we have menus for */
+static void
+registry_changed (IndicatorAppmenu * iapp, guint xid, gboolean added)
+{
+	RegistryChange change;
+
+	change.generation = ++iapp->generation;
+	change.xid = xid;
+	change.added = added;
+
+	g_array_append_val(iapp->changes, change);
+
+	/* Drop the old changes in chunks so that we're not shifting
+	   the array on every change */
+	if (iapp->changes->len > 2 * MAX_REGISTRY_CHANGES) {
+		guint drop = iapp->changes->len - MAX_REGISTRY_CHANGES;
+
+		/* Don't lose changes we haven't told anyone about yet */
+		if (iapp->signaled_generation < g_array_index(iapp->changes, RegistryChange, drop - 1).generation) {
+			windows_changed_flush(iapp);
+		}
+
+		iapp->changes_base = g_array_index(iapp->changes, RegistryChange, drop - 1).generation;
+		g_array_remove_range(iapp->changes, 0, drop);
+	}
+
+	g_clear_pointer(&iapp->unchanged_reply, g_variant_unref);
+	g_clear_pointer(&iapp->menus_snapshot, g_variant_unref);
+
+	/* Everything that changes in this pass of the main loop goes out
+	   in a single signal */
+	if (iapp->windows_changed == 0) {
+		iapp->windows_changed = g_idle_add_full(G_PRIORITY_DEFAULT, windows_changed_idle, iapp, NULL);
+	}
+}
+
+static void
+track_menus (IndicatorAppmenu * iapp, guint xid, WindowMenu * menus)
+{
+	g_return_if_fail(IS_WINDOW_MENU(menus));
+
+	WindowRecord * record = window_record_ensure(iapp, xid);
+	g_warn_if_fail(record->menus == NULL);
+	record->menus = menus;
+	record->show_now_known = FALSE;
+	owners_invalidate(iapp);
+	registry_changed(iapp, xid, TRUE);
 
 	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		GList *entries, *l;
+		IndicatorObjectEntry * const * entries;
+		guint n_entries, i;
 		WindowMenuStatus status;
 
-		connect_to_menu_signals(iapp, menus);
-		entries = window_menu_get_entries(menus);
-		status = window_menu_get_status(menus);
+		connect_to_menu_signals(iapp, menus);
+		entries = window_menu_peek_entries(menus, &n_entries, NULL);
+		status = window_menu_get_status(menus);
+
+		for (i = 0; i < n_entries; i++) {
+			window_entry_added(menus, entries[i], iapp);
+		}
+
+		if (status != WINDOW_MENU_STATUS_ACTIVE) {
+			window_status_changed(menus, status, iapp);
+		}
+	}
+}
+
+static WindowMenu *
+ensure_menus (IndicatorAppmenu * iapp, BamfWindow * window)
+{
+	WindowMenu * menus = NULL;
+	guint32 xid = 0;
+	GSList * chain = NULL;
+	gboolean cacheable = TRUE;
+
+	if (window == NULL) {
+		return NULL;
+	}
+
+	/* We've been here before, and nothing has changed since */
+	WindowRecord * first = window_record_get(iapp, bamf_window_get_xid(window));
+	if (first != NULL && first->window == window &&
+	    first->owner_generation == iapp->owner_generation) {
+		if (first->owner == 0) {
+			return NULL;
+		}
+
+		menus = window_record_get_menus(iapp, first->owner);
+		if (menus != NULL) {
+			return menus;
+		}
+	}
+
+	while (window != NULL && menus == NULL) {
+		xid = bamf_window_get_xid(window);
+
+		WindowRecord * record = window_record_get(iapp, xid);
+		if (record != NULL && record->window != window) {
+			/* Not one BAMF has told us about, don't trust the rest */
+			record = NULL;
+		}
+
+		if (record != NULL) {
+			chain = g_slist_prepend(chain, record);
+		} else {
+			/* We wouldn't hear about it closing */
+			cacheable = FALSE;
+		}
+
+		menus = window_record_get_menus(iapp, xid);
+
+		/* First look to see if we can get these from the
+		   GMenuModel access, unless we already know they're
+		   not there */
+		if (menus == NULL && (record == NULL || !record->probed)) {
+			WindowProps props = { 0 };
+
+			/* Watch before looking, so we can't miss them being set */
+			if (record != NULL) {
+				record->probed = TRUE;
+				window_record_update_watch(iapp, record);
+			}
+
+			if (window_props_fetch(xid, &props)) {
+				BamfApplication * app = NULL;
+
+				if (record != NULL) {
+					app = record->app;
+				} else {
+					app = bamf_matcher_get_application_for_window(iapp->matcher, window);
+				}
+
+				/* Found them, no need to keep watching */
+				if (record != NULL) {
+					record->probed = FALSE;
+					window_record_update_watch(iapp, record);
+				}
+
+				menus = WINDOW_MENU(window_menu_model_new(app, window, &props));
+				if (menus != NULL) {
+					track_menus(iapp, xid, menus);
+				}
+			}
+
+			window_props_clear(&props);
+		}
+
+		if (menus == NULL) {
+			g_debug("Looking for parent window on XID %d", xid);
+			if (record != NULL) {
+				window = record->transient;
+			} else {
+				window = bamf_window_get_transient(window);
+			}
+		}
+	}
+
+	/* Remember the answer for every window on the way up, tracking
+	   the menus above may have bumped the generation */
+	if (cacheable) {
+		GSList * link;
+
+		for (link = chain; link != NULL; link = g_slist_next(link)) {
+			WindowRecord * record = (WindowRecord *)link->data;
+			record->owner = menus != NULL ? xid : 0;
+			record->owner_generation = iapp->owner_generation;
+		}
+	}
+
+	g_slist_free(chain);
+
+	return menus;
+}
+
+/* Recieve the signal that the window being shown
+   has now changed. */
+static void
+active_window_changed (BamfMatcher * matcher, BamfView * oldview, BamfView * newview, gpointer user_data)
+{
+	update_active_window(INDICATOR_APPMENU(user_data), (BamfWindow *) newview);
+}
+
+/* Get the menus for one of the windows we think will be focused
+   soon ready, one per idle */
+static gboolean
+predict_idle (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	while (!g_queue_is_empty(iapp->predicted)) {
+		guint xid = GPOINTER_TO_UINT(g_queue_pop_head(iapp->predicted));
+
+		if (iapp->active_window != NULL && bamf_window_get_xid(iapp->active_window) == xid) {
+			continue;
+		}
+
+		WindowRecord * record = window_record_get(iapp, xid);
+		if (record == NULL || record->window == NULL) {
+			continue;
+		}
+
+		WindowMenu * menus = ensure_menus(iapp, record->window);
+		if (menus == NULL || window_menu_is_realized(menus)) {
+			continue;
+		}
+
+		g_debug("Preparing menus for %X", xid);
+		menus_used(iapp, menus);
+
+		return G_SOURCE_CONTINUE;
+	}
+
+	iapp->predict_idle = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+queue_prediction (IndicatorAppmenu * iapp, guint xid)
+{
+	if (g_queue_find(iapp->predicted, GUINT_TO_POINTER(xid)) != NULL) {
+		return;
+	}
+
+	g_queue_push_tail(iapp->predicted, GUINT_TO_POINTER(xid));
+
+	if (iapp->predict_idle == 0) {
+		iapp->predict_idle = g_idle_add_full(G_PRIORITY_LOW, predict_idle, iapp, NULL);
+	}
+}
+
+/* Remember that a window was focused.  The windows that were focused
+   just before it are the ones most likely to be switched back to. */
+static void
+mru_push (IndicatorAppmenu * iapp, guint xid)
+{
+	if (GPOINTER_TO_UINT(g_queue_peek_head(iapp->mru_xids)) == xid) {
+		return;
+	}
+
+	g_queue_remove(iapp->mru_xids, GUINT_TO_POINTER(xid));
+	g_queue_push_head(iapp->mru_xids, GUINT_TO_POINTER(xid));
+
+	if (g_queue_get_length(iapp->mru_xids) > MAX_MRU_WINDOWS) {
+		g_queue_pop_tail(iapp->mru_xids);
+	}
+
+	GList * link = iapp->mru_xids->head->next;
+	guint i;
+
+	for (i = 0; i < iapp->predicted_windows && link != NULL; i++, link = g_list_next(link)) {
+		queue_prediction(iapp, GPOINTER_TO_UINT(link->data));
+	}
+}
+
+/* Ask for a cardinal on a window, without waiting for it */
+static xcb_get_property_cookie_t
+request_cardinal_prop (xcb_connection_t * connection, guint32 xwindow, const gchar * name)
+{
+	return xcb_get_property(connection, FALSE, xwindow, gdk_x11_get_xatom_by_name(name),
+	                        XCB_ATOM_CARDINAL, 0, 1);
+}
+
+/* Get the cardinal we asked for, if the window has it.  An error,
+   like the window being gone, comes back as a NULL reply. */
+static gboolean
+reply_cardinal_prop (xcb_connection_t * connection, xcb_get_property_cookie_t cookie, guint32 * value)
+{
+	xcb_get_property_reply_t * reply = xcb_get_property_reply(connection, cookie, NULL);
+	gboolean found = FALSE;
+
+	if (reply == NULL) {
+		return FALSE;
+	}
+
+	if (reply->type == XCB_ATOM_CARDINAL && reply->format == 32 &&
+	    xcb_get_property_value_length(reply) == sizeof(guint32)) {
+		*value = *(guint32 *)xcb_get_property_value(reply);
+		found = TRUE;
+	}
+
+	free(reply);
+
+	return found;
+}
+
+/* The workspace changed, the windows there that were used most
+   recently are likely to be focused next.  All the requests go out
+   before we wait on any of them, so it's a single trip to the X
+   server however many windows we look at. */
+static void
+workspace_changed (IndicatorAppmenu * iapp)
+{
+	xcb_connection_t * connection = XGetXCBConnection(gdk_x11_get_default_xdisplay());
+	xcb_get_property_cookie_t cookies[MAX_MRU_WINDOWS];
+	guint xids[MAX_MRU_WINDOWS];
+	guint32 workspace, window_workspace;
+	guint n_windows = 0, queued = 0, i;
+	GList * link;
+
+	if (iapp->predicted_windows == 0) {
+		return;
+	}
+
+	xcb_get_property_cookie_t workspace_cookie = request_cardinal_prop(connection, gdk_x11_get_default_root_xwindow(), "_NET_CURRENT_DESKTOP");
+
+	for (link = iapp->mru_xids->head; link != NULL && n_windows < MAX_MRU_WINDOWS; link = g_list_next(link)) {
+		xids[n_windows] = GPOINTER_TO_UINT(link->data);
+		cookies[n_windows] = request_cardinal_prop(connection, xids[n_windows], "_NET_WM_DESKTOP");
+		n_windows++;
+	}
+
+	gboolean have_workspace = reply_cardinal_prop(connection, workspace_cookie, &workspace);
+
+	if (have_workspace) {
+		g_debug("Switched to workspace %u", workspace);
+	}
+
+	for (i = 0; i < n_windows; i++) {
+		/* Every reply has to be picked up or thrown away */
+		if (!have_workspace || queued >= iapp->predicted_windows) {
+			xcb_discard_reply(connection, cookies[i].sequence);
+			continue;
+		}
+
+		if (!reply_cardinal_prop(connection, cookies[i], &window_workspace)) {
+			continue;
+		}
+
+		/* 0xFFFFFFFF is on all of them */
+		if (window_workspace == workspace || window_workspace == 0xFFFFFFFF) {
+			queue_prediction(iapp, xids[i]);
+			queued++;
+		}
+	}
+}
+
+/* One of the windows we've looked at has changed a property.  If it's
+   the GMenuModel one it may have menus now, if it's the MWM hints or
+   the allowed actions we need them again for the close item. */
+static GdkFilterReturn
+window_filter (GdkXEvent * xevent, GdkEvent * event, gpointer user_data)
+{
+	XEvent * xev = (XEvent *)xevent;
+
+	if (xev->type != PropertyNotify) {
+		return GDK_FILTER_CONTINUE;
+	}
+
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+	WindowRecord * record = window_record_get(iapp, xev->xproperty.window);
+
+	if (record == NULL) {
+		return GDK_FILTER_CONTINUE;
+	}
+
+	/* Whether it can be closed may have changed */
+	if (xev->xproperty.atom == gdk_x11_get_xatom_by_name("_MOTIF_WM_HINTS") ||
+	    xev->xproperty.atom == gdk_x11_get_xatom_by_name("_NET_WM_ALLOWED_ACTIONS")) {
+		window_record_request_functions(iapp, record);
+
+		if (record->window != NULL && record->window == iapp->active_window &&
+		    iapp->close_item_idle == 0) {
+			iapp->close_item_idle = g_idle_add_full(G_PRIORITY_LOW, close_item_idle, iapp, NULL);
+		}
+
+		return GDK_FILTER_CONTINUE;
+	}
+
+	if (xev->xproperty.atom != gdk_x11_get_xatom_by_name("_GTK_UNIQUE_BUS_NAME")) {
+		return GDK_FILTER_CONTINUE;
+	}
+
+	if (record->probed) {
+		g_debug("Window %X has changed its GMenuModel properties", record->xid);
+		record->probed = FALSE;
+		window_record_update_watch(iapp, record);
+		owners_invalidate(iapp);
+		queue_focus_update(iapp);
+	}
+
+	return GDK_FILTER_CONTINUE;
+}
+
+/* Look for the workspace changing on the root window */
+static GdkFilterReturn
+root_filter (GdkXEvent * xevent, GdkEvent * event, gpointer user_data)
+{
+	XEvent * xev = (XEvent *)xevent;
+
+	if (xev->type == PropertyNotify &&
+	    xev->xproperty.atom == gdk_x11_get_xatom_by_name("_NET_CURRENT_DESKTOP")) {
+		workspace_changed(INDICATOR_APPMENU(user_data));
+	}
+
+	return GDK_FILTER_CONTINUE;
+}
+
+static WindowMenu *
+update_active_window (IndicatorAppmenu * appmenu, BamfWindow *window)
+{
+	WindowMenu * menus = NULL;
+
+	if (window != NULL) {
+		if (!BAMF_IS_WINDOW(window)) {
+			window = NULL;
+			g_warning("Active window changed to View thats not a window.");
+		}
+	} else {
+		g_debug("Active window is: NULL");
+	}
+
+	if (appmenu->mode == MODE_UNITY_ALL_MENUS) {
+		if (window != NULL) {
+			menus = ensure_menus(appmenu, window);
+		}
+		return menus;
+	}
+
+	if (window != NULL && bamf_window_get_window_type(window) == BAMF_WINDOW_DESKTOP) {
+		g_debug("Switching to menus from desktop");
+		switch_default_app(appmenu, NULL, NULL);
+		return menus;
+	}
+
+	/* Ask for the MWM functions for the close item now, so the reply
+	   comes back while we're getting the menus */
+	if (window != NULL && window != appmenu->active_window) {
+		WindowRecord * record = window_record_get(appmenu, bamf_window_get_xid(window));
+		if (record != NULL && !record->functions_known && !record->functions_pending) {
+			window_record_request_functions(appmenu, record);
+		}
+	}
+
+	g_debug("Switching to menus from XID %d", window ? bamf_window_get_xid(window) : 0);
+	menus = ensure_menus(appmenu, window);
+	switch_default_app(appmenu, menus, window);
+
+	if (window != NULL) {
+		mru_push(appmenu, bamf_window_get_xid(window));
+	}
+
+	return menus;
+}
+
+/* Look at which window is active now that the main loop has
+   caught up with all the registrations */
+static gboolean
+focus_update_idle (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	iapp->focus_update = 0;
+	iapp->focus_updates++;
+
+	g_debug("Re-evaluating active window: %u requests, %u updates, %u saved",
+	        iapp->focus_update_requests, iapp->focus_updates,
+	        iapp->focus_update_requests - iapp->focus_updates);
+
+	/* Note: Does not cause ref */
+	BamfWindow * win = bamf_matcher_get_active_window(iapp->matcher);
+	update_active_window(iapp, win);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Mark the active window as needing to be looked at again.  Registrations
+   tend to come in storms, so rather than doing it for each of them we
+   only do it once per main loop iteration. */
+static void
+queue_focus_update (IndicatorAppmenu * iapp)
+{
+	iapp->focus_update_requests++;
+
+	if (iapp->focus_update != 0) {
+		return;
+	}
+
+	iapp->focus_update = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, focus_update_idle, iapp, NULL);
+}
+
+/* Free a client along with the watch on its name */
+static void
+registry_client_free (gpointer data)
+{
+	RegistryClient * client = (RegistryClient *)data;
+
+	if (client->watch_id != 0) {
+		g_bus_unwatch_name(client->watch_id);
+		client->watch_id = 0;
+	}
+
+	g_hash_table_destroy(client->windows);
+	g_free(client->name);
+	g_free(client);
+}
+
+/* An application that registered windows has left the bus, so all
+   of its menus are gone with it.  Clean them all up now instead of
+   waiting for BAMF to tell us about each window. */
+static void
+registry_client_vanished (GDBusConnection * connection, const gchar * name, gpointer user_data)
+{
+	RegistryClient * client = (RegistryClient *)user_data;
+	IndicatorAppmenu * iapp = client->iapp;
+
+	/* Take it out of the index first so that we don't try to remove
+	   the windows from it one at a time while they're torn down */
+	g_hash_table_steal(iapp->clients, client->name);
+
+	GList * windows = g_hash_table_get_keys(client->windows);
+	GList * lwindow;
+
+	g_debug("Client %s left the bus, removing %u windows", name, g_list_length(windows));
+
+	for (lwindow = windows; lwindow != NULL; lwindow = g_list_next(lwindow)) {
+		unregister_window(iapp, GPOINTER_TO_UINT(lwindow->data));
+	}
+
+	g_list_free(windows);
+	registry_client_free(client);
+
+	queue_focus_update(iapp);
+}
+
+/* Find the client for a unique name, starting to watch it if it's
+   the first time we've heard from it */
+static RegistryClient *
+registry_client_get (IndicatorAppmenu * iapp, const gchar * sender)
+{
+	RegistryClient * client = g_hash_table_lookup(iapp->clients, sender);
+
+	if (client != NULL) {
+		return client;
+	}
+
+	client = g_new0(RegistryClient, 1);
+	client->iapp = iapp;
+	client->name = g_strdup(sender);
+	client->windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	client->tokens = iapp->registration_burst;
+	client->last_refill = g_get_monotonic_time();
+
+	g_hash_table_insert(iapp->clients, client->name, client);
+
+	client->watch_id = g_bus_watch_name_on_connection(iapp->bus,
+	                                                  client->name,
+	                                                  G_BUS_NAME_WATCHER_FLAGS_NONE,
+	                                                  NULL,
+	                                                  registry_client_vanished,
+	                                                  client,
+	                                                  NULL);
+
+	return client;
+}
+
+/* Make sure that a client isn't registering the same windows again
+   faster than we're willing to rebuild menus for them.  This is a token
+   bucket, a client can register a burst of windows it already has and
+   then gets more tokens back over time.  New windows are always let in,
+   the clients don't retry and those menus would be lost.  Either all the
+   tokens asked for are taken or none are. */
+static gboolean
+registry_client_take_tokens (IndicatorAppmenu * iapp, RegistryClient * client, guint count, guint repeats)
+{
+	if (iapp->registration_burst == 0 || repeats == 0) {
+		client->accepted += count;
+		return TRUE;
+	}
+
+	gint64 now = g_get_monotonic_time();
+
+	client->tokens += (gdouble)(now - client->last_refill) * iapp->registration_rate / G_USEC_PER_SEC;
+	client->tokens = MIN(client->tokens, (gdouble)iapp->registration_burst);
+	client->last_refill = now;
+
+	if (client->tokens < repeats) {
+		client->rejected += count;
+		return FALSE;
+	}
+
+	client->tokens -= repeats;
+	client->accepted += count;
+
+	return TRUE;
+}
+
+/* Drop a window from the application that registered it.  We keep the
+   client around until it leaves the bus so that unregistering doesn't
+   reset its rate limiting. */
+static void
+registry_client_remove_window (IndicatorAppmenu * iapp, const gchar * sender, guint windowid)
+{
+	if (iapp->clients == NULL || sender == NULL) {
+		return;
+	}
+
+	RegistryClient * client = g_hash_table_lookup(iapp->clients, sender);
+
+	if (client == NULL) {
+		return;
+	}
+
+	g_hash_table_remove(client->windows, GUINT_TO_POINTER(windowid));
+}
+
+/* Respond to the menus being destroyed.  We need to deregister
+   and make sure we weren't being shown.  */
+static void
+menus_destroyed (IndicatorAppmenu * iapp, guint windowid)
+{
+	gboolean reload_menus = FALSE;
+	WindowRecord * record = window_record_get(iapp, windowid);
+	g_return_if_fail (record != NULL && IS_WINDOW_MENU(record->menus));
+
+	/* Take the menus' reference, the record goes if BAMF
+	   doesn't know about the window either */
+	WindowMenu * wm = record->menus;
+	record->menus = NULL;
+	window_record_release(iapp, record);
+	owners_invalidate(iapp);
+
+	g_signal_handlers_disconnect_by_data(wm, iapp);
+	registry_changed(iapp, windowid, FALSE);
+	menus_forget(iapp, wm);
+
+	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
+		registry_client_remove_window(iapp, window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm)), windowid);
+	}
+
+	g_debug("Removing menus for %d", windowid);
+
+	if (iapp->desktop_menu == wm) {
+		iapp->desktop_menu = NULL;
+		determine_new_desktop(iapp);
+		if (iapp->default_app == NULL && iapp->active_window == NULL) {
+			reload_menus = TRUE;
+		}
+	}
+
+	/* If we're it, let's remove ourselves and BAMF will probably
+	   give us a new entry in a bit. */
+	if (iapp->default_app == wm) {
+		reload_menus = TRUE;
+	}
+
+	if (reload_menus) {
+		switch_default_app(iapp, NULL, NULL);
+	}
+
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		guint n_entries, i;
+		IndicatorObjectEntry * const * entries = window_menu_peek_entries(wm, &n_entries, NULL);
+
+		for (i = 0; i < n_entries; i++) {
+			window_entry_removed(wm, entries[i], iapp);
+		}
+	}
+
+	g_object_unref(wm);
+}
+
+/* Build the menus for one of the windows that registered while we
+   were busy, one per idle so we don't hold up anything else */
+static gboolean
+warm_up_idle (gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	while (!g_queue_is_empty(iapp->warm_up_queue)) {
+		guint xid = GPOINTER_TO_UINT(g_queue_pop_head(iapp->warm_up_queue));
+		WindowMenu * pwm = window_record_get_menus(iapp, xid);
+
+		if (pwm == NULL || window_menu_is_realized(WINDOW_MENU(pwm))) {
+			continue;
+		}
+
+		/* Don't push out menus that have actually been used */
+		if (iapp->realized_budget != 0 && g_queue_get_length(iapp->realized) >= iapp->realized_budget) {
+			g_queue_clear(iapp->warm_up_queue);
+			break;
+		}
+
+		window_menu_realize(WINDOW_MENU(pwm));
+
+		g_queue_push_tail(iapp->realized, pwm);
+		g_hash_table_insert(iapp->realized_links, pwm, iapp->realized->tail);
+
+		return G_SOURCE_CONTINUE;
+	}
+
+	iapp->warm_up_idle = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+queue_warm_up (IndicatorAppmenu * iapp, guint xid)
+{
+	g_queue_push_tail(iapp->warm_up_queue, GUINT_TO_POINTER(xid));
+
+	if (iapp->warm_up_idle == 0) {
+		iapp->warm_up_idle = g_idle_add_full(G_PRIORITY_LOW, warm_up_idle, iapp, NULL);
+	}
+}
+
+/* Builds the menus for a window that has been registered with us and
+   starts tracking them.  Returns whether we're now tracking the window. */
+static gboolean
+track_registered_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpath,
+                         const gchar * sender)
+{
+	if (windowid == 0) {
+		g_warning("Can't build windows for a NULL window ID %d with path %s from %s", windowid, objectpath, sender);
+		return FALSE;
+	}
+
+	if (window_record_get_menus(iapp, windowid) != NULL) {
+		g_warning("Already have a menu for window ID %d with path %s from %s, unregistering that one", windowid, objectpath, sender);
+		unregister_window(iapp, windowid);
+
+		/* NOTE: So we're doing a lookup here.  That seems pretty useless
+		   now doesn't it.  It's for a good reason.  We're going through
+		   a pretty complex set of functions and we want to ensure that
+		   we're not going to end up with two sets of menus for the same
+		   window otherwise things could go really bad. */
+		if (window_record_get_menus(iapp, windowid) != NULL) {
+			g_warning("Unable to unregister window!");
+			return FALSE;
+		}
+	}
+
+	WindowMenu * wm = WINDOW_MENU(window_menu_dbusmenu_new(windowid, sender, objectpath));
+	g_return_val_if_fail(wm != NULL, FALSE);
+
+	/* Everything is shown at once there, otherwise wait until the
+	   window is going to be shown */
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		window_menu_realize(wm);
+	} else if (iapp->warm_up) {
+		queue_warm_up(iapp, windowid);
+	}
+
+	track_menus(iapp, windowid, wm);
+
+	RegistryClient * client = registry_client_get(iapp, sender);
+	g_hash_table_add(client->windows, GUINT_TO_POINTER(windowid));
+
+	return TRUE;
+}
+
+/* A new window wishes to register it's windows with us */
+static GVariant *
+register_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpath,
+                 const gchar * sender, GError ** error)
+{
+	g_debug("Registering window ID %d with path %s from %s", windowid, objectpath, sender);
+
+	if (sender == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_NO_SENDER, "Windows can only be registered over the bus");
+		return NULL;
+	}
+
+	RegistryClient * client = registry_client_get(iapp, sender);
+	guint repeats = g_hash_table_contains(client->windows, GUINT_TO_POINTER(windowid)) ? 1 : 0;
+
+	if (!registry_client_take_tokens(iapp, client, 1, repeats)) {
+		g_set_error(error, error_quark(), ERROR_RATE_LIMITED, "Too many registrations from %s, try again later", sender);
+		return NULL;
+	}
+
+	if (!track_registered_window(iapp, windowid, objectpath, sender)) {
+		return g_variant_new("()");
+	}
+
+	emit_legacy_signal(iapp, "WindowRegistered",
+	            g_variant_new("(uso)", windowid, sender, objectpath));
+
+	WindowRecord * record = window_record_get(iapp, windowid);
+	if (record != NULL && record->desktop) {
+		determine_new_desktop(iapp);
+	}
+
+	queue_focus_update(iapp);
+
+	return g_variant_new("()");
+}
+
+/* An application wishes to register a whole set of windows with us,
+   we build them all and then only signal and look at the active
+   window once. */
+static GVariant *
+register_windows (IndicatorAppmenu * iapp, GVariant * windows, const gchar * sender,
+                  GError ** error)
+{
+	GVariantBuilder builder;
+	GVariantIter iter;
+	guint32 windowid;
+	const gchar * objectpath;
+	gboolean desktop_changed = FALSE;
+	guint registered = 0;
+
+	if (sender == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_NO_SENDER, "Windows can only be registered over the bus");
+		return NULL;
+	}
+
+	/* Only the windows the client already has menus for cost anything,
+	   and never more than a full bucket, otherwise a batch bigger than
+	   the burst could never get in however long the application waited */
+	RegistryClient * client = registry_client_get(iapp, sender);
+	guint repeats = 0;
+
+	g_variant_iter_init(&iter, windows);
+	while (g_variant_iter_next(&iter, "(u&o)", &windowid, &objectpath)) {
+		if (g_hash_table_contains(client->windows, GUINT_TO_POINTER(windowid))) {
+			repeats++;
+		}
+	}
+
+	if (iapp->registration_burst != 0) {
+		repeats = MIN(repeats, iapp->registration_burst);
+	}
+
+	if (!registry_client_take_tokens(iapp, client, g_variant_n_children(windows), repeats)) {
+		g_set_error(error, error_quark(), ERROR_RATE_LIMITED, "Too many registrations from %s, try again later", sender);
+		return NULL;
+	}
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(uso)"));
+
+	g_variant_iter_init(&iter, windows);
+	while (g_variant_iter_next(&iter, "(u&o)", &windowid, &objectpath)) {
+		g_debug("Registering window ID %d with path %s from %s", windowid, objectpath, sender);
+
+		if (!track_registered_window(iapp, windowid, objectpath, sender)) {
+			continue;
+		}
+
+		g_variant_builder_add(&builder, "(uso)", windowid, sender, objectpath);
+		registered++;
+
+		if (window_record_get(iapp, windowid)->desktop) {
+			desktop_changed = TRUE;
+		}
+	}
+
+	if (registered == 0) {
+		g_variant_builder_clear(&builder);
+		return g_variant_new("()");
+	}
+
+	emit_legacy_signal(iapp, "WindowsRegistered",
+	            g_variant_new("(a(uso))", &builder));
+
+	if (desktop_changed) {
+		determine_new_desktop(iapp);
+	}
+
+	queue_focus_update(iapp);
+
+	return g_variant_new("()");
+}
+
+/* Kindly remove an entry from our DB */
+static GVariant *
+unregister_window (IndicatorAppmenu * iapp, guint windowid)
+{
+	g_debug("Unregistering: %d", windowid);
+	g_return_val_if_fail(IS_INDICATOR_APPMENU(iapp), NULL);
+	g_return_val_if_fail(iapp->matcher != NULL, NULL);
+
+	emit_legacy_signal(iapp, "WindowUnregistered", g_variant_new ("(u)", windowid));
+
+	menus_destroyed(iapp, windowid);
+
+	return NULL;
+}
+
+/* Grab the menu information for a specific window */
+static GVariant *
+get_menu_for_window (IndicatorAppmenu * iapp, guint windowid, GError ** error)
+{
+	WindowMenu * wm = NULL;
+
+	if (windowid == 0) {
+		wm = iapp->default_app;
+	} else {
+		wm = window_record_get_menus(iapp, windowid);
+	}
+
+	if (wm == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_WINDOW_NOT_FOUND, "Window not found");
+		return NULL;
+	}
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
+
+	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
+		const gchar * address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
+		const gchar * path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
+		g_variant_builder_add_value(&builder, g_variant_new_string(address));
+		g_variant_builder_add_value(&builder, g_variant_new_object_path(path));
+	} else {
+		g_variant_builder_add_value(&builder, g_variant_new_string(""));
+		g_variant_builder_add_value(&builder, g_variant_new_object_path("/"));
+	}
+
+	return g_variant_builder_end(&builder);
+}
+
+/* Add the menu information for a window to a builder of a(uso) */
+static void
+add_menu_info (GVariantBuilder * builder, WindowMenu * wm)
+{
+	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
+		g_variant_builder_add (builder, "(uso)",
+		                       window_menu_get_xid(wm),
+		                       window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm)),
+		                       window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm)));
+	} else {
+		g_variant_builder_add (builder, "(uso)",
+		                       window_menu_get_xid(wm),
+		                       "",
+		                       "/");
+	}
+}
+
+/* Get all the menus we have.  The reply is kept around until the
+   set of windows changes, it isn't floating so the invocation takes
+   its own reference. */
+static GVariant *
+get_menus (IndicatorAppmenu * iapp, GError ** error)
+{
+	if (iapp->windows == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_NO_APPLICATIONS, "No applications are registered");
+		return NULL;
+	}
+
+	if (iapp->menus_snapshot != NULL) {
+		return iapp->menus_snapshot;
+	}
+
+	GVariantBuilder builder;
+	GHashTableIter hash_iter;
+	gpointer value;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE("a(uso)"));
+	g_hash_table_iter_init (&hash_iter, iapp->windows);
+	while (g_hash_table_iter_next (&hash_iter, NULL, &value)) {
+		WindowRecord * record = (WindowRecord *)value;
+		if (record->menus != NULL) {
+			add_menu_info(&builder, record->menus);
+		}
+	}
+
+	iapp->menus_snapshot = g_variant_ref_sink(g_variant_new ("(a(uso))", &builder));
+
+	return iapp->menus_snapshot;
+}
+
+/* Adds the windows that have been added or removed since a generation
+   we still have the changes for.  Generations are handed out one per
+   change so we can go directly to the first one that is wanted.  Only
+   the last change to each window matters. */
+static void
+registry_changes_since (IndicatorAppmenu * iapp, guint generation,
+                        GVariantBuilder * added, GVariantBuilder * removed)
+{
+	GHashTable * touched = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter hash_iter;
+	gpointer key, value;
+	guint i;
+
+	for (i = generation - iapp->changes_base; i < iapp->changes->len; i++) {
+		RegistryChange * change = &g_array_index(iapp->changes, RegistryChange, i);
+		g_hash_table_insert(touched, GUINT_TO_POINTER(change->xid), GINT_TO_POINTER(change->added));
+	}
+
+	g_hash_table_iter_init(&hash_iter, touched);
+	while (g_hash_table_iter_next(&hash_iter, &key, &value)) {
+		WindowMenu * wm = window_record_get_menus(iapp, GPOINTER_TO_UINT(key));
+
+		if (GPOINTER_TO_INT(value) && wm != NULL) {
+			add_menu_info(added, wm);
+		} else {
+			g_variant_builder_add(removed, "u", GPOINTER_TO_UINT(key));
+		}
+	}
+
+	g_hash_table_destroy(touched);
+}
+
+static gchar *
+registry_snapshot_path (void)
+{
+	return g_build_filename(g_get_user_runtime_dir(), REGISTRY_SNAPSHOT_NAME, NULL);
+}
+
+/* The write finished, the contents were only kept for it */
+static void
+registry_snapshot_written (GObject * object, GAsyncResult * res, gpointer user_data)
+{
+	GError * error = NULL;
+
+	if (!g_file_replace_contents_finish(G_FILE(object), res, NULL, &error)) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			gchar * path = g_file_get_path(G_FILE(object));
+			g_warning("Unable to save the registered windows to '%s': %s", path, error->message);
+			g_free(path);
+		}
+		g_error_free(error);
+	}
+
+	g_variant_unref((GVariant *)user_data);
+}
+
+/* Keep a copy of the registered windows on disk so that if we get
+   restarted the next instance can pick them back up.  It's the GetMenus
+   reply along with the GUID of the bus, unique names and window IDs
+   don't mean anything on another bus. */
+static void
+registry_snapshot_save (IndicatorAppmenu * iapp)
+{
+	if (iapp->bus == NULL) {
+		return;
+	}
+
+	GVariant * menus = get_menus(iapp, NULL);
 
-		for (l = entries; l; l = l->next) {
-			window_entry_added(menus, l->data, iapp);
-		}
+	if (menus == NULL) {
+		return;
+	}
 
-		if (status != WINDOW_MENU_STATUS_ACTIVE) {
-			window_status_changed(menus, status, iapp);
-		}
+	GVariant * windows = g_variant_get_child_value(menus, 0);
+	GVariant * contents = g_variant_ref_sink(g_variant_new("(s@a(uso))",
+	                                                       g_dbus_connection_get_guid(iapp->bus),
+	                                                       windows));
+	g_variant_unref(windows);
 
-		g_list_free(entries);
+	/* Only the newest copy is worth having */
+	if (iapp->snapshot_cancel != NULL) {
+		g_cancellable_cancel(iapp->snapshot_cancel);
+		g_object_unref(iapp->snapshot_cancel);
 	}
+	iapp->snapshot_cancel = g_cancellable_new();
+
+	gchar * path = registry_snapshot_path();
+	GFile * file = g_file_new_for_path(path);
+
+	g_file_replace_contents_async(file,
+	                              g_variant_get_data(contents),
+	                              g_variant_get_size(contents),
+	                              NULL,
+	                              FALSE,
+	                              G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+	                              iapp->snapshot_cancel,
+	                              registry_snapshot_written,
+	                              contents);
+
+	iapp->snapshot_saved = TRUE;
+
+	g_object_unref(file);
+	g_free(path);
 }
 
-static WindowMenu *
-ensure_menus (IndicatorAppmenu * iapp, BamfWindow * window)
+static gboolean
+registry_snapshot_timeout (gpointer user_data)
 {
-	WindowMenu * menus = NULL;
-	guint32 xid = 0;
-
-	while (window != NULL && menus == NULL) {
-		xid = bamf_window_get_xid(window);
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
 
-		menus = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(xid));
+	iapp->snapshot_save = 0;
+	registry_snapshot_save(iapp);
 
-		/* First look to see if we can get these from the
-		   GMenuModel access */
-		if (menus == NULL) {
-			gchar * uniquename = bamf_window_get_utf8_prop (window, "_GTK_UNIQUE_BUS_NAME");
+	return G_SOURCE_REMOVE;
+}
 
-			if (uniquename != NULL) {
-				BamfApplication * app = bamf_matcher_get_application_for_window(iapp->matcher, window);
+/* Save the registered windows after they've settled down, rather
+   than every time they change */
+static void
+registry_snapshot_queue (IndicatorAppmenu * iapp)
+{
+	if (iapp->snapshot_save == 0) {
+		iapp->snapshot_save = g_timeout_add_seconds(REGISTRY_SNAPSHOT_SECONDS, registry_snapshot_timeout, iapp);
+	}
+}
 
-				menus = WINDOW_MENU(window_menu_model_new(app, window));
-				track_menus(iapp, xid, menus);
-			}
+/* Stop any write and take our copy away, so that nothing picks it up
+   after we've gone */
+static void
+registry_snapshot_remove (IndicatorAppmenu * iapp)
+{
+	if (iapp->snapshot_save != 0) {
+		g_source_remove(iapp->snapshot_save);
+		iapp->snapshot_save = 0;
+	}
 
-			g_free(uniquename);
-		}
+	if (iapp->snapshot_cancel != NULL) {
+		g_cancellable_cancel(iapp->snapshot_cancel);
+		g_clear_object(&iapp->snapshot_cancel);
+	}
 
-		if (menus == NULL) {
-			g_debug("Looking for parent window on XID %d", xid);
-			window = bamf_window_get_transient(window);
-		}
+	/* Don't take away another instance's copy */
+	if (!iapp->snapshot_saved) {
+		return;
 	}
 
-	return menus;
+	gchar * path = registry_snapshot_path();
+	g_unlink(path);
+	g_free(path);
+
+	iapp->snapshot_saved = FALSE;
 }
 
-/* Recieve the signal that the window being shown
-   has now changed. */
 static void
-active_window_changed (BamfMatcher * matcher, BamfView * oldview, BamfView * newview, gpointer user_data)
+registry_restore_free (RegistryRestore * restore)
 {
-	update_active_window(INDICATOR_APPMENU(user_data), (BamfWindow *) newview);
+	g_object_unref(restore->iapp);
+	g_variant_unref(restore->menus);
+	g_free(restore->sender);
+	g_free(restore);
 }
 
-static WindowMenu *
-update_active_window (IndicatorAppmenu * appmenu, BamfWindow *window)
+/* We know whether a client from the last instance is still around,
+   if it is track the windows it had that still exist */
+static void
+registry_restore_name_checked (GObject * object, GAsyncResult * res, gpointer user_data)
 {
-	WindowMenu * menus = NULL;
+	RegistryRestore * restore = (RegistryRestore *)user_data;
+	IndicatorAppmenu * iapp = restore->iapp;
+	GError * error = NULL;
+	gboolean owned = FALSE;
 
-	if (window != NULL) {
-		if (!BAMF_IS_WINDOW(window)) {
-			window = NULL;
-			g_warning("Active window changed to View thats not a window.");
-		}
+	GVariant * reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(object), res, &error);
+
+	if (error != NULL) {
+		g_warning("Unable to check if %s is still around: %s", restore->sender, error->message);
+		g_error_free(error);
 	} else {
-		g_debug("Active window is: NULL");
+		g_variant_get(reply, "(b)", &owned);
+		g_variant_unref(reply);
 	}
 
-	if (appmenu->mode == MODE_UNITY_ALL_MENUS) {
-		if (window != NULL) {
-			menus = ensure_menus(appmenu, window);
-		}
-		return menus;
+	if (!owned || iapp->windows == NULL || iapp->matcher == NULL) {
+		registry_restore_free(restore);
+		return;
 	}
 
-	if (window != NULL && bamf_window_get_window_type(window) == BAMF_WINDOW_DESKTOP) {
-		g_debug("Switching to menus from desktop");
-		switch_default_app(appmenu, NULL, NULL);
-		return menus;
+	GHashTable * live = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GList * windows = bamf_matcher_get_windows(iapp->matcher);
+	GList * lwindow;
+
+	for (lwindow = windows; lwindow != NULL; lwindow = g_list_next(lwindow)) {
+		if (BAMF_IS_WINDOW(lwindow->data)) {
+			g_hash_table_add(live, GUINT_TO_POINTER(bamf_window_get_xid(BAMF_WINDOW(lwindow->data))));
+		}
 	}
 
-	g_debug("Switching to menus from XID %d", window ? bamf_window_get_xid(window) : 0);
-	menus = ensure_menus(appmenu, window);
-	switch_default_app(appmenu, menus, window);
+	g_list_free(windows);
 
-	return menus;
-}
+	GVariantIter iter;
+	guint32 windowid;
+	const gchar * sender;
+	const gchar * objectpath;
+	gboolean desktop_changed = FALSE;
+	guint restored = 0;
 
-/* Respond to the menus being destroyed.  We need to deregister
-   and make sure we weren't being shown.  */
-static void
-menus_destroyed (IndicatorAppmenu * iapp, guint windowid)
-{
-	gboolean reload_menus = FALSE;
-	WindowMenu * wm = g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid));
-	g_return_if_fail (IS_WINDOW_MENU(wm));
+	g_variant_iter_init(&iter, restore->menus);
+	while (g_variant_iter_next(&iter, "(u&s&o)", &windowid, &sender, &objectpath)) {
+		if (g_strcmp0(sender, restore->sender) != 0) {
+			continue;
+		}
 
-	g_hash_table_steal(iapp->apps, GUINT_TO_POINTER(windowid));
-	g_signal_handlers_disconnect_by_data(wm, iapp);
+		/* Either it's gone, or the app has beaten us to it */
+		if (!g_hash_table_contains(live, GUINT_TO_POINTER(windowid)) ||
+		    window_record_get_menus(iapp, windowid) != NULL) {
+			continue;
+		}
 
-	g_debug("Removing menus for %d", windowid);
+		if (!track_registered_window(iapp, windowid, objectpath, sender)) {
+			continue;
+		}
 
-	if (iapp->desktop_menu == wm) {
-		iapp->desktop_menu = NULL;
-		determine_new_desktop(iapp);
-		if (iapp->default_app == NULL && iapp->active_window == NULL) {
-			reload_menus = TRUE;
+		restored++;
+
+		if (window_record_get(iapp, windowid)->desktop) {
+			desktop_changed = TRUE;
 		}
 	}
 
-	/* If we're it, let's remove ourselves and BAMF will probably
-	   give us a new entry in a bit. */
-	if (iapp->default_app == wm) {
-		reload_menus = TRUE;
-	}
+	g_hash_table_destroy(live);
 
-	if (reload_menus) {
-		switch_default_app(iapp, NULL, NULL);
+	g_debug("Restored %u windows for %s", restored, restore->sender);
+
+	if (desktop_changed) {
+		determine_new_desktop(iapp);
 	}
 
-	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
-		GList * entries, * l;
-		entries = window_menu_get_entries(wm);
-		for (l = entries; l; l = l->next) {
-			window_entry_removed(wm, l->data, iapp);
-		}
-		g_list_free(entries);
+	if (restored > 0) {
+		queue_focus_update(iapp);
 	}
 
-	g_object_unref(wm);
+	registry_restore_free(restore);
 }
 
-/* A new window wishes to register it's windows with us */
-static GVariant *
-register_window (IndicatorAppmenu * iapp, guint windowid, const gchar * objectpath,
-                 const gchar * sender)
+/* Read the windows that the last instance had and check that each of
+   the clients that registered them is still on the bus */
+static void
+registry_snapshot_restore (IndicatorAppmenu * iapp)
 {
-	g_debug("Registering window ID %d with path %s from %s", windowid, objectpath, sender);
+	GError * error = NULL;
+	gchar * path = registry_snapshot_path();
+	GMappedFile * file = g_mapped_file_new(path, FALSE, &error);
 
-	if (g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)) == NULL && windowid != 0) {
-		WindowMenu * wm = WINDOW_MENU(window_menu_dbusmenu_new(windowid, sender, objectpath));
-		g_return_val_if_fail(wm != NULL, FALSE);
+	if (file == NULL) {
+		/* Nothing there the first time we run */
+		if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_warning("Unable to read the registered windows from '%s': %s", path, error->message);
+		}
+		g_error_free(error);
+		g_free(path);
+		return;
+	}
 
-		track_menus(iapp, windowid, wm);
+	g_free(path);
 
-		emit_signal(iapp, "WindowRegistered",
-		            g_variant_new("(uso)", windowid, sender, objectpath));
+	GBytes * bytes = g_mapped_file_get_bytes(file);
+	GVariant * snapshot = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE("(sa(uso))"), bytes, FALSE));
+	const gchar * guid = NULL;
 
-		gpointer pdesktop = g_hash_table_lookup(iapp->desktop_windows, GUINT_TO_POINTER(windowid));
-		if (pdesktop != NULL) {
-			determine_new_desktop(iapp);
-		}
+	/* From another bus, or an older format, the names and window IDs
+	   in it could belong to anyone now */
+	g_variant_get_child(snapshot, 0, "&s", &guid);
+	if (g_strcmp0(guid, g_dbus_connection_get_guid(iapp->bus)) != 0) {
+		g_debug("Ignoring the registered windows from another bus");
 
-		/* Note: Does not cause ref */
-		BamfWindow * win = bamf_matcher_get_active_window(iapp->matcher);
-		update_active_window(iapp, win);
-	} else {
-		if (windowid == 0) {
-			g_warning("Can't build windows for a NULL window ID %d with path %s from %s", windowid, objectpath, sender);
-		} else {
-			g_warning("Already have a menu for window ID %d with path %s from %s, unregistering that one", windowid, objectpath, sender);
-			unregister_window(iapp, windowid);
-
-			/* NOTE: So we're doing a lookup here.  That seems pretty useless
-			   now doesn't it.  It's for a good reason.  We're going recursive
-			   with a pretty complex set of functions we want to ensure that
-			   we're not going to end up infinitely recursive otherwise things
-			   could go really bad. */
-			if (g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)) == NULL) {
-				return register_window(iapp, windowid, objectpath, sender);
-			}
+		path = registry_snapshot_path();
+		g_unlink(path);
+		g_free(path);
 
-			g_warning("Unable to unregister window!");
+		g_variant_unref(snapshot);
+		g_bytes_unref(bytes);
+		g_mapped_file_unref(file);
+		return;
+	}
+
+	GVariant * menus = g_variant_get_child_value(snapshot, 1);
+	GHashTable * senders = g_hash_table_new(g_str_hash, g_str_equal);
+	GVariantIter iter;
+	guint32 windowid;
+	const gchar * sender;
+	const gchar * objectpath;
+
+	g_variant_iter_init(&iter, menus);
+	while (g_variant_iter_next(&iter, "(u&s&o)", &windowid, &sender, &objectpath)) {
+		/* Model based menus aren't registered, we'll find them again */
+		if (sender[0] == '\0' || g_hash_table_contains(senders, sender)) {
+			continue;
 		}
+
+		g_hash_table_add(senders, (gpointer)sender);
+
+		RegistryRestore * restore = g_new0(RegistryRestore, 1);
+		restore->iapp = g_object_ref(iapp);
+		restore->menus = g_variant_ref(menus);
+		restore->sender = g_strdup(sender);
+
+		g_dbus_connection_call(iapp->bus,
+		                       "org.freedesktop.DBus",
+		                       "/org/freedesktop/DBus",
+		                       "org.freedesktop.DBus",
+		                       "NameHasOwner",
+		                       g_variant_new("(s)", sender),
+		                       G_VARIANT_TYPE("(b)"),
+		                       G_DBUS_CALL_FLAGS_NONE,
+		                       -1,
+		                       NULL,
+		                       registry_restore_name_checked,
+		                       restore);
 	}
 
-	return g_variant_new("()");
+	g_debug("Checking %u clients from the last instance", g_hash_table_size(senders));
+
+	g_hash_table_destroy(senders);
+	g_variant_unref(menus);
+	g_variant_unref(snapshot);
+	g_bytes_unref(bytes);
+	g_mapped_file_unref(file);
 }
 
-/* Kindly remove an entry from our DB */
-static GVariant *
-unregister_window (IndicatorAppmenu * iapp, guint windowid)
+/* Tell everyone about the windows that changed since the last time */
+static void
+windows_changed_flush (IndicatorAppmenu * iapp)
 {
-	g_debug("Unregistering: %d", windowid);
-	g_return_val_if_fail(IS_INDICATOR_APPMENU(iapp), NULL);
-	g_return_val_if_fail(iapp->matcher != NULL, NULL);
+	if (iapp->windows_changed != 0) {
+		g_source_remove(iapp->windows_changed);
+		iapp->windows_changed = 0;
+	}
 
-	/* If it's a desktop window remove it from that table as well */
-	g_hash_table_remove(iapp->desktop_windows, GUINT_TO_POINTER(windowid));
+	if (iapp->signaled_generation == iapp->generation || iapp->bus == NULL) {
+		iapp->signaled_generation = iapp->generation;
+		return;
+	}
 
-	emit_signal(iapp, "WindowUnregistered", g_variant_new ("(u)", windowid));
+	GVariantBuilder added;
+	GVariantBuilder removed;
 
-	menus_destroyed(iapp, windowid);
+	g_variant_builder_init(&added, G_VARIANT_TYPE("a(uso)"));
+	g_variant_builder_init(&removed, G_VARIANT_TYPE("au"));
 
-	return NULL;
+	g_debug("Signaling %u window changes", iapp->generation - iapp->signaled_generation);
+
+	registry_changes_since(iapp, iapp->signaled_generation, &added, &removed);
+	iapp->signaled_generation = iapp->generation;
+
+	emit_signal(iapp, "WindowsChanged", g_variant_new("(a(uso)au)", &added, &removed));
+
+	registry_snapshot_queue(iapp);
 }
 
-/* Grab the menu information for a specific window */
-static GVariant *
-get_menu_for_window (IndicatorAppmenu * iapp, guint windowid, GError ** error)
+static gboolean
+windows_changed_idle (gpointer user_data)
 {
-	WindowMenu * wm = NULL;
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
 
-	if (windowid == 0) {
-		wm = iapp->default_app;
-	} else {
-		wm = WINDOW_MENU(g_hash_table_lookup(iapp->apps, GUINT_TO_POINTER(windowid)));
-	}
+	iapp->windows_changed = 0;
+	windows_changed_flush(iapp);
 
-	if (wm == NULL) {
-		g_set_error_literal(error, error_quark(), ERROR_WINDOW_NOT_FOUND, "Window not found");
+	return G_SOURCE_REMOVE;
+}
+
+/* Get the menus that have changed since the client last looked.  If we
+   don't remember that far back, or the generation isn't one of ours, the
+   client gets all of the menus and is told to reset. */
+static GVariant *
+get_menus_since (IndicatorAppmenu * iapp, guint generation, GError ** error)
+{
+	if (iapp->windows == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_NO_APPLICATIONS, "No applications are registered");
 		return NULL;
 	}
 
-	GVariantBuilder builder;
-	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
+	/* Nothing has changed, which is the common case for polling
+	   clients.  Hand back the same reply each time.  It isn't floating
+	   so the invocation takes its own reference. */
+	if (generation == iapp->generation) {
+		if (iapp->unchanged_reply == NULL) {
+			iapp->unchanged_reply = g_variant_ref_sink(g_variant_new("(ub@a(uso)@au)",
+			                                                         iapp->generation,
+			                                                         FALSE,
+			                                                         g_variant_new_array(G_VARIANT_TYPE("(uso)"), NULL, 0),
+			                                                         g_variant_new_array(G_VARIANT_TYPE_UINT32, NULL, 0)));
+		}
 
-	if (IS_WINDOW_MENU_DBUSMENU(wm)) {
-		gchar * address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
-		gchar * path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
-		g_variant_builder_add_value(&builder, g_variant_new_string(address));
-		g_variant_builder_add_value(&builder, g_variant_new_object_path(path));
-		g_free(path);
-		g_free(address);
+		return iapp->unchanged_reply;
+	}
+
+	GVariantBuilder added;
+	GVariantBuilder removed;
+	gboolean reset = FALSE;
+
+	g_variant_builder_init(&added, G_VARIANT_TYPE("a(uso)"));
+	g_variant_builder_init(&removed, G_VARIANT_TYPE("au"));
+
+	if (generation < iapp->changes_base || generation > iapp->generation) {
+		GHashTableIter hash_iter;
+		gpointer value;
+
+		reset = TRUE;
+
+		g_hash_table_iter_init(&hash_iter, iapp->windows);
+		while (g_hash_table_iter_next(&hash_iter, NULL, &value)) {
+			WindowRecord * record = (WindowRecord *)value;
+			if (record->menus != NULL) {
+				add_menu_info(&added, record->menus);
+			}
+		}
 	} else {
-		g_variant_builder_add_value(&builder, g_variant_new_string(""));
-		g_variant_builder_add_value(&builder, g_variant_new_object_path("/"));
+		registry_changes_since(iapp, generation, &added, &removed);
 	}
 
-	return g_variant_builder_end(&builder);
+	return g_variant_new("(uba(uso)au)", iapp->generation, reset, &added, &removed);
 }
 
-/* Get all the menus we have */
+/* A client wants the per-window signals as well as WindowsChanged */
 static GVariant *
-get_menus (IndicatorAppmenu * iapp, GError ** error)
+enable_legacy_signals (IndicatorAppmenu * iapp, gboolean enable, const gchar * sender,
+                       GError ** error)
 {
-	if (iapp->apps == NULL) {
-		g_set_error_literal(error, error_quark(), ERROR_NO_APPLICATIONS, "No applications are registered");
+	if (sender == NULL) {
+		g_set_error_literal(error, error_quark(), ERROR_NO_SENDER, "Per-window signals are only sent over the bus");
 		return NULL;
 	}
 
+	RegistryClient * client = registry_client_get(iapp, sender);
+	client->legacy_signals = enable;
+
+	g_debug("Client %s %s the per-window signals", sender, enable ? "wants" : "doesn't want");
+
+	return g_variant_new("()");
+}
+
+/* Get the registration statistics for each client we know about */
+static GVariant *
+get_client_statistics (IndicatorAppmenu * iapp, GError ** error)
+{
 	GVariantBuilder builder;
 	GHashTableIter hash_iter;
 	gpointer value;
 
-	g_variant_builder_init (&builder, G_VARIANT_TYPE("a(uso)"));
-	g_hash_table_iter_init (&hash_iter, iapp->apps);
-	while (g_hash_table_iter_next (&hash_iter, NULL, &value)) {
-		if (value != NULL) {
-			WindowMenu * wm = WINDOW_MENU(value);
-			if (IS_WINDOW_MENU_DBUSMENU(wm)) {
-				gchar * address = window_menu_dbusmenu_get_address(WINDOW_MENU_DBUSMENU(wm));
-				gchar * path = window_menu_dbusmenu_get_path(WINDOW_MENU_DBUSMENU(wm));
-				g_variant_builder_add (&builder, "(uso)",
-				                       window_menu_get_xid(wm),
-				                       address,
-				                       path);
-				g_free(path);
-				g_free(address);
-			} else {
-				g_variant_builder_add (&builder, "(uso)",
-				                       window_menu_get_xid(wm),
-				                       "",
-				                       "/");
-			}
-		}
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(suuu)"));
+	g_hash_table_iter_init(&hash_iter, iapp->clients);
+	while (g_hash_table_iter_next(&hash_iter, NULL, &value)) {
+		RegistryClient * client = (RegistryClient *)value;
+		g_variant_builder_add(&builder, "(suuu)",
+		                      client->name,
+		                      g_hash_table_size(client->windows),
+		                      client->accepted,
+		                      client->rejected);
 	}
 
-	return g_variant_new ("(a(uso))", &builder);
+	return g_variant_new("(a(suuu))", &builder);
+}
+
+/* Get how often the active window was asked to be looked at again
+   and how often it actually was */
+static GVariant *
+get_focus_statistics (IndicatorAppmenu * iapp, GError ** error)
+{
+	return g_variant_new("(uu)", iapp->focus_update_requests, iapp->focus_updates);
 }
 
 /* A method has been called from our dbus inteface.  Figure out what it
@@ -1327,7 +3495,12 @@ bus_method_call (GDBusConnection * connection, const gchar * sender,
 		guint32 xid;
 		const gchar * path;
 		g_variant_get(params, "(u&o)", &xid, &path);
-		retval = register_window(iapp, xid, path, sender);
+		retval = register_window(iapp, xid, path, sender, &error);
+	} else if (g_strcmp0(method, "RegisterWindows") == 0) {
+		GVariant * windows;
+		g_variant_get(params, "(@a(uo))", &windows);
+		retval = register_windows(iapp, windows, sender, &error);
+		g_variant_unref(windows);
 	} else if (g_strcmp0(method, "UnregisterWindow") == 0) {
 		guint32 xid;
 		g_variant_get(params, "(u)", &xid);
@@ -1338,6 +3511,18 @@ bus_method_call (GDBusConnection * connection, const gchar * sender,
 		retval = get_menu_for_window(iapp, xid, &error);
 	} else if (g_strcmp0(method, "GetMenus") == 0) {
 		retval = get_menus(iapp, &error);
+	} else if (g_strcmp0(method, "GetMenusSince") == 0) {
+		guint32 generation;
+		g_variant_get(params, "(u)", &generation);
+		retval = get_menus_since(iapp, generation, &error);
+	} else if (g_strcmp0(method, "GetClientStatistics") == 0) {
+		retval = get_client_statistics(iapp, &error);
+	} else if (g_strcmp0(method, "GetFocusStatistics") == 0) {
+		retval = get_focus_statistics(iapp, &error);
+	} else if (g_strcmp0(method, "EnableLegacySignals") == 0) {
+		gboolean enable;
+		g_variant_get(params, "(b)", &enable);
+		retval = enable_legacy_signals(iapp, enable, sender, &error);
 	} else {
 		g_warning("Calling method '%s' on the indicator service and it's unknown", method);
 	}
@@ -1353,10 +3538,76 @@ bus_method_call (GDBusConnection * connection, const gchar * sender,
 	return;
 }
 
+/* A property is being read from our dbus interface */
+static GVariant *
+bus_get_property (GDBusConnection * connection, const gchar * sender,
+                  const gchar * object_path, const gchar * interface,
+                  const gchar * property, GError ** error, gpointer user_data)
+{
+	IndicatorAppmenu * iapp = INDICATOR_APPMENU(user_data);
+
+	if (g_strcmp0(property, "PeerAddress") == 0) {
+		if (iapp->peer_server != NULL) {
+			return g_variant_new_string(g_dbus_server_get_client_address(iapp->peer_server));
+		} else {
+			return g_variant_new_string("");
+		}
+	}
+
+	g_warning("Getting property '%s' on the indicator service and it's unknown", property);
+	return NULL;
+}
+
+/* Put the entry into all the entries next to the ones from its own
+   window, so they stay in the window's order.  The first neighbour
+   we already have goes either side, otherwise it's a new window and
+   it goes on the end. */
+static void
+aggregate_link_entry (IndicatorAppmenu * iapp, AggregateEntry * aggregate, IndicatorObjectEntry * entry)
+{
+	guint n_entries, i;
+	IndicatorObjectEntry * const * window_entries = window_menu_peek_entries(aggregate->menus, &n_entries, NULL);
+	guint position = window_menu_get_location(aggregate->menus, entry);
+
+	if (position < n_entries) {
+		for (i = position; i > 0; i--) {
+			AggregateEntry * before = g_hash_table_lookup(iapp->entry_index, window_entries[i - 1]);
+
+			if (before != NULL && before != aggregate) {
+				g_queue_insert_after(iapp->all_entries, before->link, entry);
+				aggregate->link = before->link->next;
+				return;
+			}
+		}
+
+		for (i = position + 1; i < n_entries; i++) {
+			AggregateEntry * after = g_hash_table_lookup(iapp->entry_index, window_entries[i]);
+
+			if (after != NULL && after != aggregate) {
+				g_queue_insert_before(iapp->all_entries, after->link, entry);
+				aggregate->link = after->link->prev;
+				return;
+			}
+		}
+	}
+
+	g_queue_push_tail(iapp->all_entries, entry);
+	aggregate->link = iapp->all_entries->tail;
+}
+
 /* Pass up the entry added event */
 static void
 window_entry_added (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppmenu * iapp)
 {
+	if (iapp->mode == MODE_UNITY_ALL_MENUS && !g_hash_table_contains(iapp->entry_index, entry)) {
+		AggregateEntry * aggregate = g_new0(AggregateEntry, 1);
+
+		aggregate->menus = mw;
+		aggregate_link_entry(iapp, aggregate, entry);
+
+		g_hash_table_insert(iapp->entry_index, entry, aggregate);
+	}
+
 	entry->parent_object = INDICATOR_OBJECT(iapp);
 	g_signal_emit_by_name(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_ENTRY_ADDED, entry);
 }
@@ -1365,22 +3616,62 @@ window_entry_added (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppm
 static void
 window_entry_removed (WindowMenu * mw, IndicatorObjectEntry * entry, IndicatorAppmenu * iapp)
 {
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		AggregateEntry * aggregate = g_hash_table_lookup(iapp->entry_index, entry);
+
+		if (aggregate != NULL) {
+			g_queue_delete_link(iapp->all_entries, aggregate->link);
+			g_hash_table_remove(iapp->entry_index, entry);
+		}
+	}
+
 	entry->parent_object = INDICATOR_OBJECT(iapp);
 	g_signal_emit_by_name(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_ENTRY_REMOVED, entry);
 }
 
-/* Pass up the status changed event */
+/* Pass up the entry moved event, the positions are within the
+   window's entries same as get_location */
+static void
+window_entry_moved (WindowMenu * mw, IndicatorObjectEntry * entry, guint old_position, guint new_position, IndicatorAppmenu * iapp)
+{
+	if (iapp->mode == MODE_UNITY_ALL_MENUS) {
+		AggregateEntry * aggregate = g_hash_table_lookup(iapp->entry_index, entry);
+
+		if (aggregate != NULL) {
+			g_queue_delete_link(iapp->all_entries, aggregate->link);
+			aggregate_link_entry(iapp, aggregate, entry);
+		}
+	}
+
+	entry->parent_object = INDICATOR_OBJECT(iapp);
+	g_signal_emit_by_name(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_ENTRY_MOVED, entry, old_position, new_position);
+}
+
+/* Pass up the status changed event.  The status can be notified
+   again without changing, so skip it if it's the one we last passed
+   up and the entries haven't changed since. */
 static void
 window_status_changed (WindowMenu * mw, DbusmenuStatus status, IndicatorAppmenu * iapp)
 {
 	gboolean show_now = (status == DBUSMENU_STATUS_NOTICE);
-	GList * l, * window_entries = window_menu_get_entries(mw);
+	guint n_entries, serial, i;
+	IndicatorObjectEntry * const * window_entries = window_menu_peek_entries(mw, &n_entries, &serial);
+	WindowRecord * record = window_record_get(iapp, window_menu_get_xid(mw));
+
+	if (record != NULL && record->menus == mw) {
+		if (record->show_now_known && record->show_now == show_now &&
+		    record->show_now_serial == serial) {
+			return;
+		}
+
+		record->show_now = show_now;
+		record->show_now_serial = serial;
+		record->show_now_known = TRUE;
+	}
 
-	for (l = window_entries; l; l = l->next) {
-		IndicatorObjectEntry * entry = l->data;
-		g_signal_emit(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_SHOW_NOW_CHANGED_ID, 0, entry, show_now);
+	for (i = 0; i < n_entries; i++) {
+		g_signal_emit(G_OBJECT(iapp), INDICATOR_OBJECT_SIGNAL_SHOW_NOW_CHANGED_ID, 0, window_entries[i], show_now);
 	}
-	g_list_free (window_entries);
 }
 
 /* Pass up the show menu event */
@@ -37,11 +37,19 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 typedef struct _WindowMenuDbusmenuPrivate WindowMenuDbusmenuPrivate;
 struct _WindowMenuDbusmenuPrivate {
 	guint windowid;
+	gchar * address;
+	gchar * path;
 	DbusmenuGtkClient * client;
 	DbusmenuMenuitem * root;
 	GCancellable * props_cancel;
 	GDBusProxy * props;
 	GArray * entries;
+	GHashTable * item_entries;
+	GHashTable * entry_set;
+	guint renumber_from;
+	guint serial;
+	GPtrArray * pending_entries;
+	guint pending_idle;
 	gboolean error_state;
 	guint   retry_timer;
 };
@@ -54,32 +62,51 @@ struct _WMEntry {
 	DbusmenuMenuitem * mi;
 	WindowMenuDbusmenu * wm;
 	GVariant * vaccessible_desc;
+	guint position;
+	guint pending;
 };
 
+/* Properties changed on the item that haven't been put on the label */
+#define ENTRY_PENDING_LABEL    (1 << 0)
+#define ENTRY_PENDING_VISIBLE  (1 << 1)
+#define ENTRY_PENDING_ENABLED  (1 << 2)
+#define ENTRY_PENDING_ALL      (ENTRY_PENDING_LABEL | ENTRY_PENDING_VISIBLE | ENTRY_PENDING_ENABLED)
+
+/* Ahead of GTK's resize and redraw, so all the changes that come in
+   for a frame get laid out together */
+#define PENDING_PRIORITY  G_PRIORITY_HIGH_IDLE
+
 #define WINDOW_MENU_DBUSMENU_GET_PRIVATE(o) \
 (G_TYPE_INSTANCE_GET_PRIVATE ((o), WINDOW_MENU_DBUSMENU_TYPE, WindowMenuDbusmenuPrivate))
 
 /* Prototypes */
 
 static void window_menu_dbusmenu_dispose    (GObject *object);
+static void window_menu_dbusmenu_finalize   (GObject *object);
 static void root_changed            (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer user_data);
 static void event_status            (DbusmenuClient * client, DbusmenuMenuitem * mi, gchar * event, GVariant * evdata, guint timestamp, GError * error, gpointer user_data);
 static void item_activate           (DbusmenuClient * client, DbusmenuMenuitem * item, guint timestamp, gpointer user_data);
 static void status_changed          (DbusmenuClient * client, GParamSpec * pspec, gpointer user_data);
 static void menu_entry_added        (DbusmenuMenuitem * root, DbusmenuMenuitem * newentry, guint position, gpointer user_data);
 static void menu_entry_removed      (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpointer user_data);
+static void menu_entry_moved        (DbusmenuMenuitem * root, DbusmenuMenuitem * item, guint newpos, guint oldpos, gpointer user_data);
 static void menu_entry_realized     (DbusmenuMenuitem * newentry, gpointer user_data);
 static void menu_entry_realized_child_added (DbusmenuMenuitem * parent, DbusmenuMenuitem * child, guint position, gpointer user_data);
 static void menu_prop_changed       (DbusmenuMenuitem * item, const gchar * property, GVariant * value, gpointer user_data);
+static void entry_bind_item         (WMEntry * wmentry, DbusmenuMenuitem * item);
+static void entry_sync_props        (WMEntry * wmentry, guint props);
 static void menu_child_realized     (DbusmenuMenuitem * child, gpointer user_data);
 static void props_cb (GObject * object, GAsyncResult * res, gpointer user_data);
-static GList *          get_entries      (WindowMenu * wm);
+static IndicatorObjectEntry * const * peek_entries (WindowMenu * wm, guint * n_entries, guint * serial);
 static guint            get_location     (WindowMenu * wm, IndicatorObjectEntry * entry);
 static guint            get_xid          (WindowMenu * wm);
 static gboolean         get_error_state  (WindowMenu * wm);
 static WindowMenuStatus get_status       (WindowMenu * wm);
 static void             entry_restore    (WindowMenu * wm, IndicatorObjectEntry * entry);
 static void             entry_activate   (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp);
+static gboolean         is_realized      (WindowMenu * wm);
+static void             realize          (WindowMenu * wm);
+static void             unrealize        (WindowMenu * wm);
 
 G_DEFINE_TYPE (WindowMenuDbusmenu, window_menu_dbusmenu, WINDOW_MENU_TYPE);
 
@@ -92,15 +119,19 @@ window_menu_dbusmenu_class_init (WindowMenuDbusmenuClass *klass)
 	g_type_class_add_private (klass, sizeof (WindowMenuDbusmenuPrivate));
 
 	object_class->dispose = window_menu_dbusmenu_dispose;
+	object_class->finalize = window_menu_dbusmenu_finalize;
 
 	WindowMenuClass * menu_class = WINDOW_MENU_CLASS(klass);
-	menu_class->get_entries = get_entries;
+	menu_class->peek_entries = peek_entries;
 	menu_class->get_location = get_location;
 	menu_class->get_xid = get_xid;
 	menu_class->get_error_state = get_error_state;
 	menu_class->get_status = get_status;
 	menu_class->entry_restore = entry_restore;
 	menu_class->entry_activate = entry_activate;
+	menu_class->is_realized = is_realized;
+	menu_class->realize = realize;
+	menu_class->unrealize = unrealize;
 
 	return;
 }
@@ -119,6 +150,15 @@ window_menu_dbusmenu_init (WindowMenuDbusmenu *self)
 
 	priv->entries = g_array_new(FALSE, FALSE, sizeof(WMEntry *));
 
+	/* Finding entries by their item, and checking an entry is ours.
+	   The position in the entry is only good up to renumber_from. */
+	priv->item_entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+	priv->entry_set = g_hash_table_new(g_direct_hash, g_direct_equal);
+	priv->renumber_from = G_MAXUINT;
+
+	/* Entries with property changes waiting for pending_idle */
+	priv->pending_entries = g_ptr_array_new();
+
 	return;
 }
 
@@ -128,6 +168,11 @@ entry_free(IndicatorObjectEntry * entry)
 	g_return_if_fail(entry != NULL);
 	WMEntry * wmentry = (WMEntry *)entry;
 
+	if (wmentry->pending != 0 && wmentry->wm != NULL) {
+		g_ptr_array_remove(WINDOW_MENU_DBUSMENU_GET_PRIVATE(wmentry->wm)->pending_entries, wmentry);
+		wmentry->pending = 0;
+	}
+
 	if (wmentry->mi != NULL) {
 		g_signal_handlers_disconnect_by_func(wmentry->mi, G_CALLBACK(menu_prop_changed), &wmentry->ioentry);
 		g_object_unref(G_OBJECT(wmentry->mi));
@@ -157,6 +202,58 @@ entry_free(IndicatorObjectEntry * entry)
 	g_free(entry);
 }
 
+/* Brings the positions in the entries up to date, after they've been
+   moved around in the array */
+static void
+renumber_entries (WindowMenuDbusmenuPrivate * priv)
+{
+	guint i;
+
+	for (i = priv->renumber_from; i < priv->entries->len; i++) {
+		g_array_index(priv->entries, WMEntry *, i)->position = i;
+	}
+
+	priv->renumber_from = G_MAXUINT;
+}
+
+/* Takes the entry out of the lookups, the caller takes it out of
+   the array.  Everything after it moves down one. */
+static void
+forget_entry (WindowMenuDbusmenuPrivate * priv, WMEntry * wmentry)
+{
+	g_hash_table_remove(priv->item_entries, wmentry->mi);
+	g_hash_table_remove(priv->entry_set, wmentry);
+
+	priv->renumber_from = MIN(priv->renumber_from, wmentry->position);
+	priv->serial++;
+}
+
+/* Where the entry for an item goes in the array, after the entries
+   for the items in front of it.  Not every item has an entry yet. */
+static guint
+entry_index_for_item (WindowMenuDbusmenuPrivate * priv, DbusmenuMenuitem * item)
+{
+	GList * child;
+	guint index = 0;
+
+	if (priv->root == NULL) {
+		return priv->entries->len;
+	}
+
+	for (child = dbusmenu_menuitem_get_children(priv->root); child != NULL; child = g_list_next(child)) {
+		if (child->data == item) {
+			return index;
+		}
+
+		if (g_hash_table_contains(priv->item_entries, child->data)) {
+			index++;
+		}
+	}
+
+	/* Not on the menu anymore, put it at the end */
+	return priv->entries->len;
+}
+
 static void
 free_entries(GObject *object, gboolean should_signal)
 {
@@ -168,6 +265,7 @@ free_entries(GObject *object, gboolean should_signal)
 		while (priv->entries->len > 0) {
 			IndicatorObjectEntry * entry;
 			entry = g_array_index(priv->entries, IndicatorObjectEntry *, 0);
+			forget_entry(priv, (WMEntry *)entry);
 			g_array_remove_index(priv->entries, 0);
 			if (should_signal) {
 				g_signal_emit_by_name(object, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry, TRUE);
@@ -177,19 +275,12 @@ free_entries(GObject *object, gboolean should_signal)
 	}
 }
 
-/* Destroy objects */
+/* Drop the client and everything built from it */
 static void
-window_menu_dbusmenu_dispose (GObject *object)
+release_client (GObject *object)
 {
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(object);
 
-	free_entries(object, FALSE);
-
-	if (priv->entries != NULL) {
-		g_array_free(priv->entries, TRUE);
-		priv->entries = NULL;
-	}
-
 	if (priv->root != NULL) {
 		root_changed(DBUSMENU_CLIENT(priv->client), NULL, object);
 		g_warn_if_fail(priv->root == NULL);
@@ -217,10 +308,52 @@ window_menu_dbusmenu_dispose (GObject *object)
 		priv->retry_timer = 0;
 	}
 
+	priv->error_state = FALSE;
+
+	return;
+}
+
+/* Destroy objects */
+static void
+window_menu_dbusmenu_dispose (GObject *object)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(object);
+
+	free_entries(object, FALSE);
+
+	if (priv->entries != NULL) {
+		g_array_free(priv->entries, TRUE);
+		priv->entries = NULL;
+	}
+
+	g_clear_pointer(&priv->item_entries, g_hash_table_destroy);
+	g_clear_pointer(&priv->entry_set, g_hash_table_destroy);
+
+	if (priv->pending_idle != 0) {
+		g_source_remove(priv->pending_idle);
+		priv->pending_idle = 0;
+	}
+	g_clear_pointer(&priv->pending_entries, g_ptr_array_unref);
+
+	release_client(object);
+
 	G_OBJECT_CLASS (window_menu_dbusmenu_parent_class)->dispose (object);
 	return;
 }
 
+/* Free the strings the getters hand out */
+static void
+window_menu_dbusmenu_finalize (GObject *object)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(object);
+
+	g_free(priv->address);
+	g_free(priv->path);
+
+	G_OBJECT_CLASS (window_menu_dbusmenu_parent_class)->finalize (object);
+	return;
+}
+
 /* Retry the event sending to the server to see if we can get things
    working again. */
 static gboolean
@@ -230,6 +363,11 @@ retry_event (gpointer user_data)
 	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data), FALSE);
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
 
+	if (priv->client == NULL) {
+		priv->retry_timer = 0;
+		return FALSE;
+	}
+
 	dbusmenu_menuitem_handle_event(dbusmenu_client_get_root(DBUSMENU_CLIENT(priv->client)),
 	                               "x-appmenu-retry-ping",
 	                               NULL,
@@ -302,19 +440,18 @@ get_entry(WindowMenuDbusmenu *wm, DbusmenuMenuitem * item, guint *index)
 {
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
 
-	guint position = 0;
-	for (position = 0; position < priv->entries->len; ++position) {
-		WMEntry * entry = g_array_index(priv->entries, WMEntry *, position);
-		if (entry->mi == item) {
-			if (index != NULL) {
-				*index = position;
-			}
-			return &entry->ioentry;
-		}
+	WMEntry * entry = g_hash_table_lookup(priv->item_entries, item);
+	if (entry == NULL) {
+		/* Not found */
+		return NULL;
+	}
+
+	if (index != NULL) {
+		renumber_entries(priv);
+		*index = entry->position;
 	}
 
-	/* Not found */
-	return NULL;
+	return &entry->ioentry;
 }
 
 /* Called when a menu item wants to be displayed.  We need to see if
@@ -359,11 +496,16 @@ get_status (WindowMenu * wm)
 	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(wm), DBUSMENU_STATUS_NORMAL);
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
 
+	if (priv->client == NULL) {
+		return WINDOW_MENU_STATUS_NORMAL;
+	}
+
 	return dbusmenu_status_table[dbusmenu_client_get_status (DBUSMENU_CLIENT (priv->client))];
 }
 
-/* Build a new window menus object and attach to the signals to build
-   up the representative menu. */
+/* Build a new window menus object.  Nothing is fetched from the
+   application until the menus are realized, most windows never
+   get focus so there's no reason to build their menus. */
 WindowMenuDbusmenu *
 window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const gchar * dbus_object)
 {
@@ -378,35 +520,88 @@ window_menu_dbusmenu_new (const guint windowid, const gchar * dbus_addr, const g
 
 	priv->windowid = windowid;
 
+	/* These get asked for a lot and never change.  They're copies
+	   rather than interned as unique names are never reused, so the
+	   intern table would only ever grow. */
+	priv->address = g_strdup(dbus_addr);
+	priv->path = g_strdup(dbus_object);
+
+	return newmenu;
+}
+
+/* Whether we've built the client yet */
+static gboolean
+is_realized (WindowMenu * wm)
+{
+	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(wm), FALSE);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	return priv->client != NULL;
+}
+
+/* Attach to the application and the signals to build up the
+   representative menu. */
+static void
+realize (WindowMenu * wm)
+{
+	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(wm));
+	WindowMenuDbusmenu * self = WINDOW_MENU_DBUSMENU(wm);
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(self);
+
+	if (priv->client != NULL) {
+		return;
+	}
+
+	g_debug("Realizing windows menu: %X", priv->windowid);
+
 	/* Build the service proxy */
 	priv->props_cancel = g_cancellable_new();
-	g_object_ref(newmenu); /* Take a ref for the async callback */
+	g_object_ref(self); /* Take a ref for the async callback */
 	g_dbus_proxy_new_for_bus(G_BUS_TYPE_SESSION,
 	                         G_DBUS_PROXY_FLAGS_NONE,
 	                         NULL,
-	                         dbus_addr,
-	                         dbus_object,
+	                         priv->address,
+	                         priv->path,
 	                         "org.freedesktop.DBus.Properties",
 	                         priv->props_cancel,
 	                         props_cb,
-	                         newmenu);
+	                         self);
 
-	priv->client = dbusmenu_gtkclient_new((gchar *)dbus_addr, (gchar *)dbus_object);
+	priv->client = dbusmenu_gtkclient_new(priv->address, priv->path);
 	GtkAccelGroup * agroup = gtk_accel_group_new();
 	dbusmenu_gtkclient_set_accel_group(priv->client, agroup);
 	g_object_unref(agroup);
 
-	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_GTKCLIENT_SIGNAL_ROOT_CHANGED, G_CALLBACK(root_changed),   newmenu);
-	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_EVENT_RESULT, G_CALLBACK(event_status), newmenu);
-	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_ITEM_ACTIVATE, G_CALLBACK(item_activate), newmenu);
-	g_signal_connect(G_OBJECT(priv->client), "notify::" DBUSMENU_CLIENT_PROP_STATUS, G_CALLBACK(status_changed), newmenu);
+	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_GTKCLIENT_SIGNAL_ROOT_CHANGED, G_CALLBACK(root_changed),   self);
+	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_EVENT_RESULT, G_CALLBACK(event_status), self);
+	g_signal_connect(G_OBJECT(priv->client), DBUSMENU_CLIENT_SIGNAL_ITEM_ACTIVATE, G_CALLBACK(item_activate), self);
+	g_signal_connect(G_OBJECT(priv->client), "notify::" DBUSMENU_CLIENT_PROP_STATUS, G_CALLBACK(status_changed), self);
 
 	DbusmenuMenuitem * root = dbusmenu_client_get_root(DBUSMENU_CLIENT(priv->client));
 	if (root != NULL) {
-		root_changed(DBUSMENU_CLIENT(priv->client), root, newmenu);
+		root_changed(DBUSMENU_CLIENT(priv->client), root, self);
 	}
 
-	return newmenu;
+	return;
+}
+
+/* Go back to just knowing where the menus are, they'll be
+   fetched again if we're realized again */
+static void
+unrealize (WindowMenu * wm)
+{
+	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(wm));
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+
+	if (priv->client == NULL) {
+		return;
+	}
+
+	g_debug("Unrealizing windows menu: %X", priv->windowid);
+
+	free_entries(G_OBJECT(wm), TRUE);
+	release_client(G_OBJECT(wm));
+
+	return;
 }
 
 /* Callback from trying to create the proxy for the service, this
@@ -418,7 +613,10 @@ props_cb (GObject * object, GAsyncResult * res, gpointer user_data)
 	GDBusProxy * proxy = g_dbus_proxy_new_for_bus_finish(res, &error);
 
 	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* We were unrealized, the cancellable is already gone but
+		   we still have the ref we took for the callback */
 		g_error_free (error);
+		g_object_unref(user_data);
 		return; // Must exit before accessing freed memory
 	}
 
@@ -458,42 +656,31 @@ get_location (WindowMenu * wm, IndicatorObjectEntry * entry)
 		return G_MAXUINT;
 	}
 
-	guint i;
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
-	for (i = 0; i < priv->entries->len; i++) {
-		if (entry == g_array_index(priv->entries, IndicatorObjectEntry *, i)) {
-			break;
-		}
-	}
-
-	if (i == priv->entries->len) {
+	if (!g_hash_table_contains(priv->entry_set, entry)) {
 		return G_MAXUINT;
 	}
 
-	return i;
+	renumber_entries(priv);
+
+	return ((WMEntry *)entry)->position;
 }
 
-/* Get the entries that we have */
-static GList *
-get_entries (WindowMenu * wm)
+/* Get the entries that we have, they're in the array already */
+static IndicatorObjectEntry * const *
+peek_entries (WindowMenu * wm, guint * n_entries, guint * serial)
 {
 	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(wm), NULL);
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
 
-	int i;
-	GList * output = NULL;
-	for (i = 0; i < priv->entries->len; i++) {
-		output = g_list_prepend(output, g_array_index(priv->entries, IndicatorObjectEntry *, i));
-	}
-	if (output != NULL) {
-		output = g_list_reverse(output);
-	}
+	*n_entries = priv->entries->len;
+	*serial = priv->serial;
 
-	return output;
+	return (IndicatorObjectEntry * const *)priv->entries->data;
 }
 
 /* Goes through the items in the root node and adds them
-   to the flock */
+   to the flock, the ones with a kept entry just get their menu */
 static void
 new_root_helper (DbusmenuMenuitem * item, gpointer user_data)
 {
@@ -515,6 +702,128 @@ remove_menuitem_signals (DbusmenuMenuitem * mi, gpointer user_data)
 	return;
 }
 
+/* Claims the entry for the item, taking it out of both lookups so
+   nothing else matches it */
+static void
+keep_entry (WindowMenuDbusmenuPrivate * priv, WMEntry * wmentry, DbusmenuMenuitem * item, GHashTable * by_id, GHashTable * by_label, GHashTable * kept)
+{
+	const gchar * label = dbusmenu_menuitem_property_get(wmentry->mi, DBUSMENU_MENUITEM_PROP_LABEL);
+
+	g_hash_table_remove(by_id, GINT_TO_POINTER(dbusmenu_menuitem_get_id(wmentry->mi)));
+	if (label != NULL && g_hash_table_lookup(by_label, label) == wmentry) {
+		g_hash_table_remove(by_label, label);
+	}
+
+	g_hash_table_add(kept, wmentry);
+	g_hash_table_insert(priv->item_entries, item, wmentry);
+
+	return;
+}
+
+/* Some applications replace the whole root on every layout change
+   while most of the menus stay the same.  Keep the entries whose item
+   is still there, matching first on the item ID and then on the label,
+   and move them onto the new items.  Only the entries that went away
+   get removed, the new ones come in as the new items get realized. */
+static void
+reconcile_entries (WindowMenuDbusmenu * wm, DbusmenuMenuitem * new_root)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
+	GHashTable * by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTable * by_label = g_hash_table_new(g_str_hash, g_str_equal);
+	GHashTable * kept = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GList * children;
+	guint i;
+
+	/* The first entry wins when the labels are the same */
+	for (i = 0; i < priv->entries->len; i++) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i);
+		const gchar * label = dbusmenu_menuitem_property_get(wmentry->mi, DBUSMENU_MENUITEM_PROP_LABEL);
+
+		g_hash_table_insert(by_id, GINT_TO_POINTER(dbusmenu_menuitem_get_id(wmentry->mi)), wmentry);
+		if (label != NULL && !g_hash_table_contains(by_label, label)) {
+			g_hash_table_insert(by_label, (gpointer)label, wmentry);
+		}
+	}
+
+	/* Those are keyed by the old items, the kept entries go back
+	   in under the new ones */
+	g_hash_table_remove_all(priv->item_entries);
+
+	/* IDs first, so a label can't take an entry from the item with
+	   its ID */
+	for (children = dbusmenu_menuitem_get_children(new_root); children != NULL; children = g_list_next(children)) {
+		WMEntry * wmentry = g_hash_table_lookup(by_id, GINT_TO_POINTER(dbusmenu_menuitem_get_id(children->data)));
+
+		if (wmentry != NULL) {
+			keep_entry(priv, wmentry, children->data, by_id, by_label, kept);
+		}
+	}
+
+	for (children = dbusmenu_menuitem_get_children(new_root); children != NULL; children = g_list_next(children)) {
+		const gchar * label = dbusmenu_menuitem_property_get(children->data, DBUSMENU_MENUITEM_PROP_LABEL);
+
+		if (label == NULL || g_hash_table_contains(priv->item_entries, children->data)) {
+			continue;
+		}
+
+		WMEntry * wmentry = g_hash_table_lookup(by_label, label);
+		if (wmentry != NULL) {
+			keep_entry(priv, wmentry, children->data, by_id, by_label, kept);
+		}
+	}
+
+	/* The old labels are borrowed from the old items, done with them
+	   before any of them get rebound */
+	g_hash_table_destroy(by_label);
+	g_hash_table_destroy(by_id);
+
+	/* Drop the ones that are gone */
+	for (i = priv->entries->len; i > 0; i--) {
+		WMEntry * wmentry = g_array_index(priv->entries, WMEntry *, i - 1);
+
+		if (g_hash_table_contains(kept, wmentry)) {
+			continue;
+		}
+
+		forget_entry(priv, wmentry);
+		g_array_remove_index(priv->entries, i - 1);
+		g_signal_emit_by_name(G_OBJECT(wm), WINDOW_MENU_SIGNAL_ENTRY_REMOVED, &wmentry->ioentry, TRUE);
+		entry_free(&wmentry->ioentry);
+	}
+
+	g_hash_table_destroy(kept);
+
+	/* Put the rest on their new items and in the new order, the
+	   entries in front of the target are already in place */
+	i = 0;
+	for (children = dbusmenu_menuitem_get_children(new_root); children != NULL; children = g_list_next(children)) {
+		WMEntry * wmentry = g_hash_table_lookup(priv->item_entries, children->data);
+		guint current;
+
+		if (wmentry == NULL) {
+			continue;
+		}
+
+		entry_bind_item(wmentry, DBUSMENU_MENUITEM(children->data));
+
+		for (current = i; g_array_index(priv->entries, WMEntry *, current) != wmentry; current++);
+
+		if (current != i) {
+			g_array_remove_index(priv->entries, current);
+			g_array_insert_val(priv->entries, i, wmentry);
+			priv->renumber_from = MIN(priv->renumber_from, i);
+			g_signal_emit_by_name(G_OBJECT(wm), WINDOW_MENU_SIGNAL_ENTRY_MOVED, &wmentry->ioentry, current, i);
+		}
+
+		i++;
+	}
+
+	priv->serial++;
+
+	return;
+}
+
 /* Respond to the root menu item on our client changing */
 static void
 root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer user_data)
@@ -522,9 +831,6 @@ root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer use
 	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data));
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
 
-	/* Remove the old entries */
-	free_entries(G_OBJECT(user_data), TRUE);
-
 	if (priv->root != NULL) {
 		dbusmenu_menuitem_foreach(priv->root, remove_menuitem_signals, user_data);
 		g_signal_handlers_disconnect_by_data(priv->root, user_data);
@@ -533,6 +839,13 @@ root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer use
 
 	priv->root = new_root;
 
+	/* Keep what we can of the old entries */
+	if (new_root == NULL) {
+		free_entries(G_OBJECT(user_data), TRUE);
+	} else if (priv->entries->len > 0) {
+		reconcile_entries(WINDOW_MENU_DBUSMENU(user_data), new_root);
+	}
+
 	/* See if we've got new entries */
 	if (new_root == NULL) {
 		return;
@@ -543,7 +856,7 @@ root_changed (DbusmenuClient * client, DbusmenuMenuitem * new_root, gpointer use
 	/* Set up signals */
 	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_ADDED,   G_CALLBACK(menu_entry_added),   user_data);
 	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_REMOVED, G_CALLBACK(menu_entry_removed), user_data);
-	/* TODO: Child Moved */
+	g_signal_connect(G_OBJECT(new_root), DBUSMENU_MENUITEM_SIGNAL_CHILD_MOVED,   G_CALLBACK(menu_entry_moved),   user_data);
 
 	/* Add the new entries */
 	GList * children = dbusmenu_menuitem_get_children(new_root);
@@ -644,38 +957,162 @@ menu_entry_realized (DbusmenuMenuitem * newentry, gpointer user_data)
 	return;
 }
 
+/* Puts all the property changes since the last time on the labels */
+static gboolean
+pending_idle (gpointer user_data)
+{
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
+
+	priv->pending_idle = 0;
+
+	/* Syncing takes the entry off the list */
+	while (priv->pending_entries->len > 0) {
+		WMEntry * wmentry = g_ptr_array_index(priv->pending_entries, priv->pending_entries->len - 1);
+		entry_sync_props(wmentry, 0);
+	}
+
+	return FALSE;
+}
+
 /* Respond to properties changing on the menu item so that we can
-   properly hide and show them. */
+   properly hide and show them.  They're applied in pending_idle. */
 static void
 menu_prop_changed (DbusmenuMenuitem * item, const gchar * property, GVariant * value, gpointer user_data)
 {
-	IndicatorObjectEntry * entry = (IndicatorObjectEntry *)user_data;
 	WMEntry * wmentry = (WMEntry *)user_data;
+	guint prop;
 
 	if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_VISIBLE)) {
-		if (g_variant_get_boolean(value)) {
-			gtk_widget_show(GTK_WIDGET(entry->label));
-			wmentry->hidden = FALSE;
-		} else {
-			gtk_widget_hide(GTK_WIDGET(entry->label));
-			wmentry->hidden = TRUE;
-		}
+		prop = ENTRY_PENDING_VISIBLE;
 	} else if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_ENABLED)) {
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), g_variant_get_boolean(value));
-		wmentry->disabled = !g_variant_get_boolean(value);
+		prop = ENTRY_PENDING_ENABLED;
 	} else if (!g_strcmp0(property, DBUSMENU_MENUITEM_PROP_LABEL)) {
-		const gchar* str = g_variant_get_string(value, NULL);
-		if(str != NULL)
-			gtk_label_set_text_with_mnemonic(entry->label, str);
+		prop = ENTRY_PENDING_LABEL;
+	} else {
+		return;
+	}
+
+	if (wmentry->wm == NULL) {
+		entry_sync_props(wmentry, prop);
+		return;
+	}
+
+	/* The values get read off the item when they're applied, so
+	   changing a property again before then costs nothing */
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wmentry->wm);
+
+	if (wmentry->pending == 0) {
+		g_ptr_array_add(priv->pending_entries, wmentry);
+	}
+	wmentry->pending |= prop;
+
+	if (priv->pending_idle == 0) {
+		priv->pending_idle = g_idle_add_full(PENDING_PRIORITY, pending_idle, wmentry->wm, NULL);
+	}
+
+	return;
+}
+
+/* Points the entry at the item and brings the label and its state
+   in line with the item's properties.  Used for new entries and for
+   ones kept across a root change. */
+static void
+entry_bind_item (WMEntry * wmentry, DbusmenuMenuitem * item)
+{
+	if (wmentry->mi != item) {
+		IndicatorObjectEntry * entry = &wmentry->ioentry;
+
+		if (wmentry->mi != NULL) {
+			g_signal_handlers_disconnect_by_func(wmentry->mi, G_CALLBACK(menu_prop_changed), entry);
+			g_object_unref(G_OBJECT(wmentry->mi));
+		}
+
+		wmentry->mi = g_object_ref(G_OBJECT(item));
+		g_signal_connect(G_OBJECT(item), DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED, G_CALLBACK(menu_prop_changed), entry);
+	}
+
+	entry_sync_props(wmentry, ENTRY_PENDING_ALL);
+
+	return;
+}
+
+/* Puts the item's properties on the label, the ones in props or
+   waiting to be applied.  Only sends the accessible update if the
+   label really changed. */
+static void
+entry_sync_props (WMEntry * wmentry, guint props)
+{
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+	DbusmenuMenuitem * item = wmentry->mi;
+
+	props |= wmentry->pending;
+
+	if (wmentry->pending != 0 && wmentry->wm != NULL) {
+		g_ptr_array_remove(WINDOW_MENU_DBUSMENU_GET_PRIVATE(wmentry->wm)->pending_entries, wmentry);
+	}
+	wmentry->pending = 0;
+
+	GVariant * label = (props & ENTRY_PENDING_LABEL) ? dbusmenu_menuitem_property_get_variant(item, DBUSMENU_MENUITEM_PROP_LABEL) : NULL;
+	if (label != NULL && (wmentry->vaccessible_desc == NULL || !g_variant_equal(label, wmentry->vaccessible_desc))) {
+		gtk_label_set_text_with_mnemonic(entry->label, g_variant_get_string(label, NULL));
 		g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
-		entry->accessible_desc = g_variant_get_string(value, NULL);
-		wmentry->vaccessible_desc = g_variant_ref(value);
+		wmentry->vaccessible_desc = g_variant_ref(label);
+		entry->accessible_desc = g_variant_get_string(wmentry->vaccessible_desc, NULL);
 
-		if (wmentry->wm != NULL) {
+		if (wmentry->wm != NULL && g_hash_table_contains(WINDOW_MENU_DBUSMENU_GET_PRIVATE(wmentry->wm)->entry_set, wmentry)) {
 			g_signal_emit_by_name(G_OBJECT(wmentry->wm), WINDOW_MENU_SIGNAL_A11Y_UPDATE, entry, TRUE);
 		}
 	}
 
+	if (props & ENTRY_PENDING_VISIBLE) {
+		if (dbusmenu_menuitem_property_get_variant(item, DBUSMENU_MENUITEM_PROP_VISIBLE) != NULL
+			&& dbusmenu_menuitem_property_get_bool(item, DBUSMENU_MENUITEM_PROP_VISIBLE) == FALSE) {
+			gtk_widget_hide(GTK_WIDGET(entry->label));
+			wmentry->hidden = TRUE;
+		} else {
+			gtk_widget_show(GTK_WIDGET(entry->label));
+			wmentry->hidden = FALSE;
+		}
+	}
+
+	if (props & ENTRY_PENDING_ENABLED) {
+		gboolean sensitive = TRUE;
+		if (dbusmenu_menuitem_property_get_variant (item, DBUSMENU_MENUITEM_PROP_ENABLED) != NULL) {
+			sensitive = dbusmenu_menuitem_property_get_bool(item, DBUSMENU_MENUITEM_PROP_ENABLED);
+		}
+		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), sensitive);
+		wmentry->disabled = !sensitive;
+	}
+
+	return;
+}
+
+/* Swaps the submenu of the entry for the one the client built for
+   its item */
+static void
+entry_set_menu (WMEntry * wmentry, GtkMenu * menu)
+{
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+
+	if (entry->menu == menu) {
+		return;
+	}
+
+	if (entry->menu != NULL) {
+		g_signal_handlers_disconnect_by_func(entry->menu, G_CALLBACK(gtk_widget_destroyed), &entry->menu);
+		g_object_unref(entry->menu);
+		entry->menu = NULL;
+	}
+
+	if (menu == NULL) {
+		g_debug("Submenu for %s is NULL", dbusmenu_menuitem_property_get(wmentry->mi, DBUSMENU_MENUITEM_PROP_LABEL));
+		return;
+	}
+
+	entry->menu = g_object_ref(menu);
+	gtk_menu_detach(entry->menu);
+	g_signal_connect(entry->menu, "destroy", G_CALLBACK(gtk_widget_destroyed), &entry->menu);
+
 	return;
 }
 
@@ -702,70 +1139,41 @@ menu_child_realized (DbusmenuMenuitem * child, gpointer user_data)
 	}
 
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
-	WMEntry * wmentry = g_new0(WMEntry, 1);
-	wmentry->wm = wm;
-	IndicatorObjectEntry * entry = &wmentry->ioentry;
-	entry->parent_window = priv->windowid;
 
-	wmentry->mi = newentry;
-	g_object_ref(G_OBJECT(wmentry->mi));
-
-	entry->label = GTK_LABEL(gtk_label_new_with_mnemonic(dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL)));
-
-	if (entry->label != NULL) {
-		g_object_ref_sink(entry->label);
-	}
-
-	g_clear_pointer(&wmentry->vaccessible_desc, g_variant_unref);
-	wmentry->vaccessible_desc = g_variant_ref(dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
-	entry->accessible_desc = g_variant_get_string(wmentry->vaccessible_desc, NULL);
-
-	entry->menu = dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry);
-
-	if (entry->menu == NULL) {
-		g_debug("Submenu for %s is NULL", dbusmenu_menuitem_property_get(newentry, DBUSMENU_MENUITEM_PROP_LABEL));
-	} else {
-		g_object_ref(entry->menu);
-		gtk_menu_detach(entry->menu);
-		g_signal_connect(entry->menu, "destroy", G_CALLBACK(gtk_widget_destroyed), &entry->menu);
+	/* Kept from before a root change, it only needs the menu the
+	   client built for the new item */
+	WMEntry * wmentry = g_hash_table_lookup(priv->item_entries, newentry);
+	if (wmentry != NULL) {
+		entry_set_menu(wmentry, dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry));
+		g_object_unref(newentry);
+		return;
 	}
 
-	g_signal_connect(G_OBJECT(newentry), DBUSMENU_MENUITEM_SIGNAL_PROPERTY_CHANGED, G_CALLBACK(menu_prop_changed), entry);
+	wmentry = g_new0(WMEntry, 1);
+	wmentry->wm = wm;
+	IndicatorObjectEntry * entry = &wmentry->ioentry;
+	entry->parent_window = priv->windowid;
 
-	if (dbusmenu_menuitem_property_get_variant(newentry, DBUSMENU_MENUITEM_PROP_VISIBLE) != NULL
-		&& dbusmenu_menuitem_property_get_bool(newentry, DBUSMENU_MENUITEM_PROP_VISIBLE) == FALSE) {
-		gtk_widget_hide(GTK_WIDGET(entry->label));
-		wmentry->hidden = TRUE;
-	} else {
-		gtk_widget_show(GTK_WIDGET(entry->label));
-		wmentry->hidden = FALSE;
-	}
+	entry->label = GTK_LABEL(gtk_label_new(NULL));
+	g_object_ref_sink(entry->label);
 
-	if (dbusmenu_menuitem_property_get_variant (newentry, DBUSMENU_MENUITEM_PROP_ENABLED) != NULL) {
-		gboolean sensitive = dbusmenu_menuitem_property_get_bool(newentry, DBUSMENU_MENUITEM_PROP_ENABLED);
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->label), sensitive);
-		wmentry->disabled = !sensitive;
-	}
+	entry_bind_item(wmentry, newentry);
+	entry_set_menu(wmentry, dbusmenu_gtkclient_menuitem_get_submenu(priv->client, newentry));
 
-	g_array_append_val(priv->entries, wmentry);
+	/* Put it in with the entries of the items around it, the ones
+	   after it move along */
+	guint index = entry_index_for_item(priv, newentry);
+	wmentry->position = index;
+	g_array_insert_val(priv->entries, index, wmentry);
+	g_hash_table_insert(priv->item_entries, wmentry->mi, wmentry);
+	g_hash_table_add(priv->entry_set, wmentry);
+	priv->renumber_from = MIN(priv->renumber_from, index + 1);
+	priv->serial++;
 
 	g_signal_emit_by_name(G_OBJECT(wm), WINDOW_MENU_SIGNAL_ENTRY_ADDED, entry, TRUE);
 
 	g_object_unref(newentry);
 
-	guint pos = dbusmenu_menuitem_get_position (newentry,
-	                                            dbusmenu_menuitem_get_parent (newentry));
-	if (pos < priv->entries->len - 1) {
-		/* Our entry added signals that we pass up don't have position
-		   information, so we can only add to the end of the list of
-		   entries.  So when we get an inserted-in-the-middle entry,
-		   we fake a root change to remove all entries and add them
-		   back up again */
-		g_object_ref(priv->root);
-		root_changed(DBUSMENU_CLIENT(priv->client), priv->root, wm);
-		g_object_unref(priv->root);
-	}
-
 	return;
 }
 
@@ -785,6 +1193,7 @@ menu_entry_removed (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpoint
 	IndicatorObjectEntry * entry = get_entry(WINDOW_MENU_DBUSMENU(user_data), oldentry, &position);
 
 	if (entry != NULL) {
+		forget_entry(priv, (WMEntry *)entry);
 		g_array_remove_index(priv->entries, position);
 		g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry, TRUE);
 		entry_free(entry);
@@ -799,6 +1208,38 @@ menu_entry_removed (DbusmenuMenuitem * root, DbusmenuMenuitem * oldentry, gpoint
 	return;
 }
 
+/* Respond to an entry getting moved around the menu */
+static void
+menu_entry_moved (DbusmenuMenuitem * root, DbusmenuMenuitem * item, guint newpos, guint oldpos, gpointer user_data)
+{
+	g_return_if_fail(IS_WINDOW_MENU_DBUSMENU(user_data));
+	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(user_data);
+
+	guint old_index;
+	IndicatorObjectEntry * entry = get_entry(WINDOW_MENU_DBUSMENU(user_data), item, &old_index);
+
+	if (entry == NULL) {
+		/* Not realized yet, it'll go in the right place when it is */
+		return;
+	}
+
+	WMEntry * wmentry = (WMEntry *)entry;
+	g_array_remove_index(priv->entries, old_index);
+	guint new_index = entry_index_for_item(priv, item);
+	g_array_insert_val(priv->entries, new_index, wmentry);
+
+	if (new_index == old_index) {
+		return;
+	}
+
+	priv->renumber_from = MIN(priv->renumber_from, MIN(old_index, new_index));
+	priv->serial++;
+
+	g_signal_emit_by_name(G_OBJECT(user_data), WINDOW_MENU_SIGNAL_ENTRY_MOVED, entry, old_index, new_index);
+
+	return;
+}
+
 /* Get the XID of this window */
 static guint
 get_xid (WindowMenu * wm)
@@ -809,31 +1250,21 @@ get_xid (WindowMenu * wm)
 }
 
 /* Get the path for this object */
-gchar *
+const gchar *
 window_menu_dbusmenu_get_path (WindowMenuDbusmenu * wm)
 {
 	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(wm), NULL);
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
-	GValue obj = {0};
-	g_value_init(&obj, G_TYPE_STRING);
-	g_object_get_property(G_OBJECT(priv->client), DBUSMENU_CLIENT_PROP_DBUS_OBJECT, &obj);
-	gchar * retval = g_value_dup_string(&obj);
-	g_value_unset(&obj);
-	return retval;
+	return priv->path;
 }
 
 /* Get the address of this object */
-gchar *
+const gchar *
 window_menu_dbusmenu_get_address (WindowMenuDbusmenu * wm)
 {
 	g_return_val_if_fail(IS_WINDOW_MENU_DBUSMENU(wm), NULL);
 	WindowMenuDbusmenuPrivate * priv = WINDOW_MENU_DBUSMENU_GET_PRIVATE(wm);
-	GValue obj = {0};
-	g_value_init(&obj, G_TYPE_STRING);
-	g_object_get_property(G_OBJECT(priv->client), DBUSMENU_CLIENT_PROP_DBUS_NAME, &obj);
-	gchar * retval = g_value_dup_string(&obj);
-	g_value_unset(&obj);
-	return retval;
+	return priv->address;
 }
 
 /* Return whether we're in an error state or not */
@@ -21,6 +21,8 @@
 #include "config.h"
 #endif
 
+#include <string.h> /* memset() */
+
 #include <libbamf/libbamf.h>
 #include <gio/gio.h>
 #include <gtk/gtk.h>
@@ -45,6 +47,26 @@ struct _WindowMenuModelPrivate {
 	/* Window Menus */
 	GDBusMenuModel * win_menu_model;
 	GtkMenuBar * win_menu;
+
+	/* The entries in order, the application menu first.  The
+	   positions in the window entries are good up to renumber_from */
+	GPtrArray * entries;
+	guint renumber_from;
+	guint serial;
+
+	/* Entries with property changes waiting for pending_idle */
+	GPtrArray * pending_entries;
+	guint pending_idle;
+
+	/* Where the menus are, so we can build them again */
+	gboolean realized;
+	gchar * unique_bus_name;
+	gchar * app_menu_object_path;
+	gchar * menubar_object_path;
+	gchar * application_object_path;
+	gchar * window_object_path;
+	gchar * unity_object_path;
+	gchar * app_name;
 };
 
 #define WINDOW_MENU_MODEL_GET_PRIVATE(o) \
@@ -56,12 +78,17 @@ static void                window_menu_model_init       (WindowMenuModel *self);
 static void                window_menu_model_dispose    (GObject *object);
 
 /* Window Menu subclassin' */
-static GList *             get_entries                  (WindowMenu * wm);
+static IndicatorObjectEntry * const * peek_entries     (WindowMenu * wm,
+                                                         guint * n_entries,
+                                                         guint * serial);
 static guint               get_location                 (WindowMenu * wm,
                                                          IndicatorObjectEntry * entry);
 static WindowMenuStatus    get_status                   (WindowMenu * wm);
 static gboolean            get_error_state              (WindowMenu * wm);
 static guint               get_xid                      (WindowMenu * wm);
+static gboolean            is_realized                  (WindowMenu * wm);
+static void                realize                      (WindowMenu * wm);
+static void                unrealize                    (WindowMenu * wm);
 
 /* GLib boilerplate */
 G_DEFINE_TYPE (WindowMenuModel, window_menu_model, WINDOW_MENU_TYPE);
@@ -74,6 +101,32 @@ G_DEFINE_TYPE (WindowMenuModel, window_menu_model, WINDOW_MENU_TYPE);
 /* Entry data on the menuitem */
 #define ENTRY_DATA  "window-menu-model-menuitem-entry"
 
+typedef struct _WindowMenuEntry WindowMenuEntry;
+struct _WindowMenuEntry {
+	IndicatorObjectEntry entry;
+
+	GtkMenuItem * gmi;
+	guint position;
+
+	WindowMenuModel * menu;
+	guint pending;
+};
+
+/* Properties changed on the menu item that haven't been put on the
+   entry yet */
+#define ENTRY_PENDING_LABEL      (1 << 0)
+#define ENTRY_PENDING_VISIBLE    (1 << 1)
+#define ENTRY_PENDING_SENSITIVE  (1 << 2)
+
+/* Ahead of GTK's resize and redraw, so all the changes that come in
+   for a frame get laid out together */
+#define PENDING_PRIORITY  G_PRIORITY_HIGH_IDLE
+
+/* Action groups and menu models that all the windows of an
+   application share, by kind, bus name and object path.  Only weak
+   references are kept here. */
+static GHashTable * shared_objects = NULL;
+
 static void
 window_menu_model_class_init (WindowMenuModelClass *klass)
 {
@@ -85,11 +138,14 @@ window_menu_model_class_init (WindowMenuModelClass *klass)
 
 	WindowMenuClass * wm_class = WINDOW_MENU_CLASS(klass);
 
-	wm_class->get_entries = get_entries;
+	wm_class->peek_entries = peek_entries;
 	wm_class->get_location = get_location;
 	wm_class->get_status = get_status;
 	wm_class->get_error_state = get_error_state;
 	wm_class->get_xid = get_xid;
+	wm_class->is_realized = is_realized;
+	wm_class->realize = realize;
+	wm_class->unrealize = unrealize;
 
 	return;
 }
@@ -101,6 +157,10 @@ window_menu_model_init (WindowMenuModel *self)
 
 	self->priv->accel_group = gtk_accel_group_new();
 
+	self->priv->entries = g_ptr_array_new();
+	self->priv->renumber_from = G_MAXUINT;
+	self->priv->pending_entries = g_ptr_array_new();
+
 	return;
 }
 
@@ -109,21 +169,331 @@ window_menu_model_dispose (GObject *object)
 {
 	WindowMenuModel * menu = WINDOW_MENU_MODEL(object);
 
+	unrealize(WINDOW_MENU(menu));
+
+	g_clear_object(&menu->priv->accel_group);
+	g_clear_pointer(&menu->priv->entries, g_ptr_array_unref);
+	g_clear_pointer(&menu->priv->pending_entries, g_ptr_array_unref);
+
+	g_clear_pointer(&menu->priv->unique_bus_name, g_free);
+	g_clear_pointer(&menu->priv->app_menu_object_path, g_free);
+	g_clear_pointer(&menu->priv->menubar_object_path, g_free);
+	g_clear_pointer(&menu->priv->application_object_path, g_free);
+	g_clear_pointer(&menu->priv->window_object_path, g_free);
+	g_clear_pointer(&menu->priv->unity_object_path, g_free);
+	g_clear_pointer(&menu->priv->app_name, g_free);
+
+	G_OBJECT_CLASS (window_menu_model_parent_class)->dispose (object);
+	return;
+}
+
+/* A shared object was finalized, take it out of the cache */
+static void
+shared_object_gone (gpointer data, GObject * where_the_object_was)
+{
+	g_hash_table_remove(shared_objects, data);
+}
+
+/* Look for an object that another window already has */
+static GObject *
+shared_object_lookup (const gchar * kind, const gchar * bus, const gchar * path)
+{
+	if (shared_objects == NULL) {
+		return NULL;
+	}
+
+	gchar * key = g_strdup_printf("%s %s %s", kind, bus, path);
+	GObject * object = g_hash_table_lookup(shared_objects, key);
+	g_free(key);
+
+	return object;
+}
+
+/* Let other windows find an object we've created */
+static void
+shared_object_add (const gchar * kind, const gchar * bus, const gchar * path, GObject * object)
+{
+	if (shared_objects == NULL) {
+		shared_objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	gchar * key = g_strdup_printf("%s %s %s", kind, bus, path);
+
+	g_hash_table_insert(shared_objects, key, object);
+	g_object_weak_ref(object, shared_object_gone, key);
+}
+
+/* Get the action group at a path, from another window if possible */
+static GActionGroup *
+get_action_group (GDBusConnection * session, const gchar * bus, const gchar * path)
+{
+	GObject * group = shared_object_lookup("actions", bus, path);
+
+	if (group != NULL) {
+		return G_ACTION_GROUP(g_object_ref(group));
+	}
+
+	group = G_OBJECT(g_dbus_action_group_get(session, bus, path));
+	shared_object_add("actions", bus, path, group);
+
+	return G_ACTION_GROUP(group);
+}
+
+/* Get the menu model at a path, from another window if possible */
+static GDBusMenuModel *
+get_menu_model (GDBusConnection * session, const gchar * bus, const gchar * path)
+{
+	GObject * model = shared_object_lookup("menu", bus, path);
+
+	if (model != NULL) {
+		return G_DBUS_MENU_MODEL(g_object_ref(model));
+	}
+
+	model = G_OBJECT(g_dbus_menu_model_get(session, bus, path));
+	shared_object_add("menu", bus, path, model);
+
+	return G_DBUS_MENU_MODEL(model);
+}
+
+/* Build the application menu for this window.  The model and the
+   application actions are shared with the other windows, but a
+   GtkMenu can only be attached in one place and has to act on this
+   window's actions, so every window gets its own. */
+static GtkMenu *
+build_application_menu (WindowMenuModel * menu)
+{
+	GtkMenu * appmenu = GTK_MENU(gtk_menu_new_from_model(G_MENU_MODEL(menu->priv->app_menu_model)));
+
+	if (menu->priv->app_actions) {
+		gtk_widget_insert_action_group(GTK_WIDGET(appmenu), ACTION_MUX_PREFIX_APP, menu->priv->app_actions);
+	}
+
+	if (menu->priv->win_actions) {
+		gtk_widget_insert_action_group(GTK_WIDGET(appmenu), ACTION_MUX_PREFIX_WIN, menu->priv->win_actions);
+	}
+
+	if (menu->priv->unity_actions) {
+		gtk_widget_insert_action_group(GTK_WIDGET(appmenu), ACTION_MUX_PREFIX_UNITY, menu->priv->unity_actions);
+	}
+
+	gtk_widget_show(GTK_WIDGET(appmenu));
+	g_object_ref_sink(appmenu);
+
+	return appmenu;
+}
+
+/* Done with the application menu */
+static void
+destroy_application_menu (GtkMenu * appmenu)
+{
+	gtk_widget_destroy(GTK_WIDGET(appmenu));
+	g_object_unref(appmenu);
+}
+
+/* Puts an entry into the array, everything after it moves up one */
+static void
+entries_insert (WindowMenuModel * menu, guint index, IndicatorObjectEntry * entry)
+{
+	GPtrArray * entries = menu->priv->entries;
+
+	index = MIN(index, entries->len);
+
+	g_ptr_array_add(entries, entry);
+	memmove(&entries->pdata[index + 1], &entries->pdata[index], (entries->len - index - 1) * sizeof(gpointer));
+	entries->pdata[index] = entry;
+
+	menu->priv->renumber_from = MIN(menu->priv->renumber_from, index);
+	menu->priv->serial++;
+}
+
+/* Takes an entry out of the array, everything after it moves down one */
+static void
+entries_remove (WindowMenuModel * menu, guint index)
+{
+	g_ptr_array_remove_index(menu->priv->entries, index);
+
+	menu->priv->renumber_from = MIN(menu->priv->renumber_from, index);
+	menu->priv->serial++;
+}
+
+/* Brings the positions in the window entries up to date */
+static void
+entries_renumber (WindowMenuModel * menu)
+{
+	GPtrArray * entries = menu->priv->entries;
+	guint i;
+
+	for (i = menu->priv->renumber_from; i < entries->len; i++) {
+		if (entries->pdata[i] != &menu->priv->application_menu) {
+			((WindowMenuEntry *)entries->pdata[i])->position = i;
+		}
+	}
+
+	menu->priv->renumber_from = G_MAXUINT;
+}
+
+/* Where an entry is in the array, G_MAXUINT if it isn't */
+static guint
+entries_find (WindowMenuModel * menu, IndicatorObjectEntry * entry)
+{
+	if (entry == NULL) {
+		return G_MAXUINT;
+	}
+
+	if (entry == &menu->priv->application_menu) {
+		return menu->priv->has_application_menu ? 0 : G_MAXUINT;
+	}
+
+	entries_renumber(menu);
+
+	guint position = ((WindowMenuEntry *)entry)->position;
+	if (position < menu->priv->entries->len &&
+	    g_ptr_array_index(menu->priv->entries, position) == entry) {
+		return position;
+	}
+
+	return G_MAXUINT;
+}
+
+/* Takes the entry off the pending list, whatever was waiting on it
+   isn't needed anymore */
+static void
+pending_forget (WindowMenuEntry * entry)
+{
+	if (entry->pending != 0) {
+		g_ptr_array_remove(entry->menu->priv->pending_entries, entry);
+		entry->pending = 0;
+	}
+}
+
+/* Drops all the pending changes, the entries are going away */
+static void
+pending_clear (WindowMenuModel * menu)
+{
+	if (menu->priv->pending_entries == NULL) {
+		return;
+	}
+
+	while (menu->priv->pending_entries->len > 0) {
+		pending_forget(g_ptr_array_index(menu->priv->pending_entries, 0));
+	}
+
+	if (menu->priv->pending_idle != 0) {
+		g_source_remove(menu->priv->pending_idle);
+		menu->priv->pending_idle = 0;
+	}
+}
+
+/* Puts the menu item's properties that changed on the entry.  They're
+   read off the item here, so a property that changed several times
+   only gets set once. */
+static void
+entry_sync_props (WindowMenuEntry * entry)
+{
+	GtkWidget * widget = GTK_WIDGET(entry->gmi);
+	guint props = entry->pending;
+
+	pending_forget(entry);
+
+	if ((props & ENTRY_PENDING_LABEL) && entry->entry.label != NULL) {
+		const gchar * label = gtk_menu_item_get_label(entry->gmi);
+		if (g_strcmp0(label, gtk_label_get_label(entry->entry.label)) != 0) {
+			gtk_label_set_label(entry->entry.label, label);
+		}
+	}
+
+	if (props & ENTRY_PENDING_VISIBLE) {
+		gboolean visible = gtk_widget_get_visible(widget);
+
+		if (entry->entry.label != NULL) {
+			gtk_widget_set_visible(GTK_WIDGET(entry->entry.label), visible);
+		}
+
+		if (entry->entry.image != NULL) {
+			gtk_widget_set_visible(GTK_WIDGET(entry->entry.image), visible);
+		}
+	}
+
+	if (props & ENTRY_PENDING_SENSITIVE) {
+		gboolean sensitive = gtk_widget_get_sensitive(widget);
+
+		if (entry->entry.label != NULL) {
+			gtk_widget_set_sensitive(GTK_WIDGET(entry->entry.label), sensitive);
+		}
+
+		if (entry->entry.image != NULL) {
+			gtk_widget_set_sensitive(GTK_WIDGET(entry->entry.image), sensitive);
+		}
+	}
+}
+
+/* Puts all the property changes since the last time on the entries */
+static gboolean
+pending_idle (gpointer user_data)
+{
+	WindowMenuModel * menu = WINDOW_MENU_MODEL(user_data);
+
+	menu->priv->pending_idle = 0;
+
+	/* Syncing takes the entry off the list */
+	while (menu->priv->pending_entries->len > 0) {
+		guint last = menu->priv->pending_entries->len - 1;
+		entry_sync_props(g_ptr_array_index(menu->priv->pending_entries, last));
+	}
+
+	return FALSE;
+}
+
+/* Notes the property changed, it gets applied in pending_idle */
+static void
+entry_queue_props (WindowMenuEntry * entry, guint props)
+{
+	WindowMenuModel * menu = entry->menu;
+
+	if (entry->pending == 0) {
+		g_ptr_array_add(menu->priv->pending_entries, entry);
+	}
+	entry->pending |= props;
+
+	if (menu->priv->pending_idle == 0) {
+		menu->priv->pending_idle = g_idle_add_full(PENDING_PRIORITY, pending_idle, menu, NULL);
+	}
+}
+
+/* Drop the menus and the actions, keeping just enough to
+   build them again */
+static void
+unrealize (WindowMenu * wm)
+{
+	g_return_if_fail(IS_WINDOW_MENU_MODEL(wm));
+	WindowMenuModel * menu = WINDOW_MENU_MODEL(wm);
+
 	if (menu->priv->has_application_menu) {
-		g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, &menu->priv->application_menu);
+		entries_remove(menu, 0);
 		menu->priv->has_application_menu = FALSE;
+		g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, &menu->priv->application_menu);
 	}
 
-	g_clear_object(&menu->priv->accel_group);
-
 	/* Application Menu */
 	g_clear_object(&menu->priv->app_menu_model);
 	g_clear_object(&menu->priv->application_menu.label);
-	g_clear_object(&menu->priv->application_menu.menu);
+	g_clear_pointer(&menu->priv->application_menu.menu, destroy_application_menu);
 
 	/* Window Menus */
 	g_clear_object(&menu->priv->win_menu_model);
 
+	/* The entries go with the menu items */
+	pending_clear(menu);
+
+	/* Only the window's entries are left, let everyone know they're
+	   going before the menu items take them with them */
+	while (menu->priv->entries != NULL && menu->priv->entries->len > 0) {
+		IndicatorObjectEntry * entry = g_ptr_array_index(menu->priv->entries, 0);
+		entries_remove(menu, 0);
+		g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry);
+	}
+	menu->priv->renumber_from = G_MAXUINT;
+
 	if (menu->priv->win_menu) {
 		g_signal_handlers_disconnect_by_data(menu->priv->win_menu, menu);
 		gtk_widget_destroy (GTK_WIDGET (menu->priv->win_menu));
@@ -135,14 +505,15 @@ window_menu_model_dispose (GObject *object)
 	g_clear_object(&menu->priv->win_actions);
 	g_clear_object(&menu->priv->app_actions);
 
-	G_OBJECT_CLASS (window_menu_model_parent_class)->dispose (object);
+	menu->priv->realized = FALSE;
+
 	return;
 }
 
 /* Adds the application menu and turns the whole thing into an object
    entry that can be used elsewhere */
 static void
-add_application_menu (WindowMenuModel * menu, const gchar * appname, GMenuModel * model)
+add_application_menu (WindowMenuModel * menu, const gchar * appname, GDBusMenuModel * model)
 {
 	g_return_if_fail(G_IS_MENU_MODEL(model));
 
@@ -157,21 +528,10 @@ add_application_menu (WindowMenuModel * menu, const gchar * appname, GMenuModel
 	g_object_ref_sink(menu->priv->application_menu.label);
 	gtk_widget_show(GTK_WIDGET(menu->priv->application_menu.label));
 
-	menu->priv->application_menu.menu = GTK_MENU(gtk_menu_new_from_model(model));
-	if (menu->priv->app_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_APP, menu->priv->app_actions);
-	}
-	if (menu->priv->win_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_WIN, menu->priv->win_actions);
-	}
-	if (menu->priv->unity_actions) {
-		gtk_widget_insert_action_group(GTK_WIDGET(menu->priv->application_menu.menu), ACTION_MUX_PREFIX_UNITY, menu->priv->unity_actions);
-	}
-
-	gtk_widget_show(GTK_WIDGET(menu->priv->application_menu.menu));
-	g_object_ref_sink(menu->priv->application_menu.menu);
+	menu->priv->application_menu.menu = build_application_menu(menu);
 
 	menu->priv->has_application_menu = TRUE;
+	entries_insert(menu, 0, &menu->priv->application_menu);
 	g_signal_emit_by_name(menu, WINDOW_MENU_SIGNAL_ENTRY_ADDED, &menu->priv->application_menu);
 }
 
@@ -242,27 +602,12 @@ mi_find_menu (GtkMenuItem * mi)
 	}
 }
 
-typedef struct _WindowMenuEntry WindowMenuEntry;
-struct _WindowMenuEntry {
-	IndicatorObjectEntry entry;
-
-	GtkMenuItem * gmi;
-};
-
 /* Sync the menu label changing to the label object */
 static void
 entry_label_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
 {
 	g_return_if_fail(GTK_IS_MENU_ITEM(obj));
-
-	GtkMenuItem * gmi = GTK_MENU_ITEM(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
-
-	if (entry->entry.label != NULL) {
-		const gchar * label = gtk_menu_item_get_label(gmi);
-		gtk_label_set_label(entry->entry.label, label);
-	}
-
+	entry_queue_props((WindowMenuEntry *)user_data, ENTRY_PENDING_LABEL);
 	return;
 }
 
@@ -272,18 +617,7 @@ static void
 entry_visible_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
 {
 	g_return_if_fail(GTK_IS_WIDGET(obj));
-	GtkWidget * widget = GTK_WIDGET(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
-	gboolean visible = gtk_widget_get_visible(widget);
-
-	if (entry->entry.label != NULL) {
-		gtk_widget_set_visible(GTK_WIDGET(entry->entry.label), visible);
-	}
-
-	if (entry->entry.image != NULL) {
-		gtk_widget_set_visible(GTK_WIDGET(entry->entry.image), visible);
-	}
-
+	entry_queue_props((WindowMenuEntry *)user_data, ENTRY_PENDING_VISIBLE);
 	return;
 }
 
@@ -293,18 +627,7 @@ static void
 entry_sensitive_notify (GObject * obj, GParamSpec * pspec, gpointer user_data)
 {
 	g_return_if_fail(GTK_IS_WIDGET(obj));
-	GtkWidget * widget = GTK_WIDGET(obj);
-	WindowMenuEntry * entry = (WindowMenuEntry *)user_data;
-	gboolean sensitive = gtk_widget_get_sensitive(widget);
-
-	if (entry->entry.label != NULL) {
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->entry.label), sensitive);
-	}
-
-	if (entry->entry.image != NULL) {
-		gtk_widget_set_sensitive(GTK_WIDGET(entry->entry.image), sensitive);
-	}
-
+	entry_queue_props((WindowMenuEntry *)user_data, ENTRY_PENDING_SENSITIVE);
 	return;
 }
 
@@ -331,6 +654,7 @@ entry_on_menuitem (WindowMenuModel * menu, GtkMenuItem * gmi)
 	WindowMenuEntry * entry = g_new0(WindowMenuEntry, 1);
 
 	entry->gmi = gmi;
+	entry->menu = menu;
 
 	entry->entry.parent_window = menu->priv->xid;
 	entry->entry.label = mi_find_label(GTK_WIDGET(gmi));
@@ -375,14 +699,28 @@ item_inserted_cb (GtkContainer *menu,
                   gint          position,
                   gpointer      data)
 {
+	WindowMenuModel * wmenu = WINDOW_MENU_MODEL(data);
+
 	if (g_object_get_data(G_OBJECT(widget), ENTRY_DATA) == NULL) {
-		entry_on_menuitem(WINDOW_MENU_MODEL(data), GTK_MENU_ITEM(widget));
+		entry_on_menuitem(wmenu, GTK_MENU_ITEM(widget));
+	}
+
+	IndicatorObjectEntry * entry = g_object_get_data(G_OBJECT(widget), ENTRY_DATA);
+	if (entry == NULL) {
+		return;
 	}
 
-	if (g_object_get_data(G_OBJECT(widget), ENTRY_DATA) != NULL) {
-		g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_ADDED, g_object_get_data(G_OBJECT(widget), ENTRY_DATA));
+	/* The menu bar counts from its first item, we count from the
+	   application menu.  Negative is the end. */
+	guint index = G_MAXUINT;
+	if (position >= 0) {
+		index = position + (wmenu->priv->has_application_menu ? 1 : 0);
 	}
 
+	entries_insert(wmenu, index, entry);
+
+	g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_ADDED, entry);
+
 	return;
 }
 
@@ -390,17 +728,31 @@ item_inserted_cb (GtkContainer *menu,
 static void
 item_removed_cb (GtkContainer *menu, GtkWidget *widget, gpointer data)
 {
-	g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, g_object_get_data(G_OBJECT(widget), ENTRY_DATA));
+	WindowMenuModel * wmenu = WINDOW_MENU_MODEL(data);
+	IndicatorObjectEntry * entry = g_object_get_data(G_OBJECT(widget), ENTRY_DATA);
+
+	if (entry == NULL) {
+		return;
+	}
+
+	guint index = entries_find(wmenu, entry);
+	if (index != G_MAXUINT) {
+		entries_remove(wmenu, index);
+	}
+
+	pending_forget((WindowMenuEntry *)entry);
+
+	g_signal_emit_by_name(data, WINDOW_MENU_SIGNAL_ENTRY_REMOVED, entry);
 }
 
 /* Adds the window menu and turns it into a set of IndicatorObjectEntries
    that can be used elsewhere */
 static void
-add_window_menu (WindowMenuModel * menu, GMenuModel * model)
+add_window_menu (WindowMenuModel * menu, GDBusMenuModel * model)
 {
 	menu->priv->win_menu_model = g_object_ref(model);
 
-	menu->priv->win_menu = GTK_MENU_BAR(gtk_menu_bar_new_from_model(model));
+	menu->priv->win_menu = GTK_MENU_BAR(gtk_menu_bar_new_from_model(G_MENU_MODEL(model)));
 	g_assert(menu->priv->win_menu != NULL);
 	g_object_ref_sink(menu->priv->win_menu);
 
@@ -424,6 +776,11 @@ add_window_menu (WindowMenuModel * menu, GMenuModel * model)
 		}
 
 		entry_on_menuitem(menu, gmi);
+
+		IndicatorObjectEntry * entry = g_object_get_data(G_OBJECT(gmi), ENTRY_DATA);
+		if (entry != NULL) {
+			entries_insert(menu, G_MAXUINT, entry);
+		}
 	}
 	g_list_free(children);
 
@@ -432,76 +789,97 @@ add_window_menu (WindowMenuModel * menu, GMenuModel * model)
 
 /* Builds the menu model from the window for the application */
 WindowMenuModel *
-window_menu_model_new (BamfApplication * app, BamfWindow * window)
+window_menu_model_new (BamfApplication * app, BamfWindow * window, WindowProps * props)
 {
 	g_return_val_if_fail(BAMF_IS_APPLICATION(app), NULL);
 	g_return_val_if_fail(BAMF_IS_WINDOW(window), NULL);
+	g_return_val_if_fail(props != NULL, NULL);
 
-	WindowMenuModel * menu = g_object_new(WINDOW_MENU_MODEL_TYPE, NULL);
-
-	menu->priv->xid = bamf_window_get_xid(window);
-
-	gchar *unique_bus_name;
-	gchar *app_menu_object_path;
-	gchar *menubar_object_path;
-	gchar *application_object_path;
-	gchar *window_object_path;
-	gchar *unity_object_path;
-	GDBusConnection *session;
-
-	unique_bus_name = bamf_window_get_utf8_prop (window, "_GTK_UNIQUE_BUS_NAME");
-
-	if (unique_bus_name == NULL) {
+	if (props->unique_bus_name == NULL) {
 		/* If this isn't set, we won't get very far... */
 		return NULL;
 	}
 
-	app_menu_object_path = bamf_window_get_utf8_prop (window, "_GTK_APP_MENU_OBJECT_PATH");
-	menubar_object_path = bamf_window_get_utf8_prop (window, "_GTK_MENUBAR_OBJECT_PATH");
-	application_object_path = bamf_window_get_utf8_prop (window, "_GTK_APPLICATION_OBJECT_PATH");
-	window_object_path = bamf_window_get_utf8_prop (window, "_GTK_WINDOW_OBJECT_PATH");
-	unity_object_path = bamf_window_get_utf8_prop (window, "_UNITY_OBJECT_PATH");
-
-	session = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
-
-	/* Setup actions */
-	if (application_object_path != NULL) {
-		menu->priv->app_actions = G_ACTION_GROUP(g_dbus_action_group_get (session, unique_bus_name, application_object_path));
-	}
+	WindowMenuModel * menu = g_object_new(WINDOW_MENU_MODEL_TYPE, NULL);
 
-	if (window_object_path != NULL) {
-		menu->priv->win_actions = G_ACTION_GROUP(g_dbus_action_group_get (session, unique_bus_name, window_object_path));
-	}
+	menu->priv->xid = bamf_window_get_xid(window);
 
-	if (unity_object_path != NULL) {
-		menu->priv->unity_actions = G_ACTION_GROUP(g_dbus_action_group_get (session, unique_bus_name, unity_object_path));
-	}
+	/* Take the strings, the props are left empty */
+	menu->priv->unique_bus_name = props->unique_bus_name;
+	menu->priv->app_menu_object_path = props->app_menu_object_path;
+	menu->priv->menubar_object_path = props->menubar_object_path;
+	menu->priv->application_object_path = props->application_object_path;
+	menu->priv->window_object_path = props->window_object_path;
+	menu->priv->unity_object_path = props->unity_object_path;
+	memset(props, 0, sizeof(WindowProps));
 
-	/* Build us some menus */
-	if (app_menu_object_path != NULL) {
+	if (menu->priv->app_menu_object_path != NULL) {
 		const gchar * desktop_path = bamf_application_get_desktop_file(app);
-		gchar * app_name = NULL;
 
 		if (desktop_path != NULL) {
 			GDesktopAppInfo * desktop = g_desktop_app_info_new_from_filename(desktop_path);
 
 			if (desktop != NULL) {
-				app_name = g_strdup(g_app_info_get_name(G_APP_INFO(desktop)));
+				menu->priv->app_name = g_strdup(g_app_info_get_name(G_APP_INFO(desktop)));
 
 				g_object_unref(desktop);
 			}
 		}
+	}
 
-		GMenuModel * model = G_MENU_MODEL(g_dbus_menu_model_get (session, unique_bus_name, app_menu_object_path));
+	realize(WINDOW_MENU(menu));
 
-		add_application_menu(menu, app_name, model);
+	return menu;
+}
+
+/* Whether we've got the menus built right now */
+static gboolean
+is_realized (WindowMenu * wm)
+{
+	g_return_val_if_fail(IS_WINDOW_MENU_MODEL(wm), FALSE);
+	return WINDOW_MENU_MODEL(wm)->priv->realized;
+}
+
+/* Get the actions and menus from the application */
+static void
+realize (WindowMenu * wm)
+{
+	g_return_if_fail(IS_WINDOW_MENU_MODEL(wm));
+	WindowMenuModel * menu = WINDOW_MENU_MODEL(wm);
+
+	if (menu->priv->realized) {
+		return;
+	}
+
+	menu->priv->realized = TRUE;
+
+	GDBusConnection * session = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+
+	/* Setup actions, the ones for the application come from the
+	   other windows of the application if they have them */
+	if (menu->priv->application_object_path != NULL) {
+		menu->priv->app_actions = get_action_group(session, menu->priv->unique_bus_name, menu->priv->application_object_path);
+	}
+
+	if (menu->priv->window_object_path != NULL) {
+		menu->priv->win_actions = get_action_group(session, menu->priv->unique_bus_name, menu->priv->window_object_path);
+	}
+
+	if (menu->priv->unity_object_path != NULL) {
+		menu->priv->unity_actions = get_action_group(session, menu->priv->unique_bus_name, menu->priv->unity_object_path);
+	}
+
+	/* Build us some menus */
+	if (menu->priv->app_menu_object_path != NULL) {
+		GDBusMenuModel * model = get_menu_model(session, menu->priv->unique_bus_name, menu->priv->app_menu_object_path);
+
+		add_application_menu(menu, menu->priv->app_name, model);
 
 		g_object_unref(model);
-		g_free(app_name);
 	}
 
-	if (menubar_object_path != NULL) {
-		GMenuModel * model = G_MENU_MODEL(g_dbus_menu_model_get (session, unique_bus_name, menubar_object_path));
+	if (menu->priv->menubar_object_path != NULL) {
+		GDBusMenuModel * model = get_menu_model(session, menu->priv->unique_bus_name, menu->priv->menubar_object_path);
 
 		add_window_menu(menu, model);
 
@@ -512,54 +890,22 @@ window_menu_model_new (BamfApplication * app, BamfWindow * window)
 	 * enabled/disabled.  how to deal with that?
 	 */
 
-	g_free (unique_bus_name);
-	g_free (app_menu_object_path);
-	g_free (menubar_object_path);
-	g_free (application_object_path);
-	g_free (window_object_path);
-	g_free (unity_object_path);
-
 	g_object_unref (session);
 
-	return menu;
+	return;
 }
 
-/* Get the list of entries */
-static GList *
-get_entries (WindowMenu * wm)
+/* Get the entries, they're kept in order as the menus change */
+static IndicatorObjectEntry * const *
+peek_entries (WindowMenu * wm, guint * n_entries, guint * serial)
 {
 	g_return_val_if_fail(IS_WINDOW_MENU_MODEL(wm), NULL);
 	WindowMenuModel * menu = WINDOW_MENU_MODEL(wm);
 
-	GList * ret = NULL;
-
-	if (menu->priv->has_application_menu) {
-		ret = g_list_append(ret, &menu->priv->application_menu);
-	}
-
-	if (menu->priv->win_menu != NULL) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(menu->priv->win_menu));
-		GList * child;
-		for (child = children; child != NULL; child = g_list_next(child)) {
-			gpointer entry = g_object_get_data(child->data, ENTRY_DATA);
-
-			if (entry == NULL) {
-				/* Try to build the entry, it is possible (but unlikely) that
-				   we could beat the signal that this isn't created.  So we'll
-				   just handle that race here */
-				entry_on_menuitem(menu, GTK_MENU_ITEM(child->data));
-				entry = g_object_get_data(child->data, ENTRY_DATA);
-			}
-
-			if (entry != NULL) {
-				ret = g_list_append(ret, entry);
-			}
-		}
+	*n_entries = menu->priv->entries->len;
+	*serial = menu->priv->serial;
 
-		g_list_free(children);
-	}
-
-	return ret;
+	return (IndicatorObjectEntry * const *)menu->priv->entries->pdata;
 }
 
 /* Find the location of an entry */
@@ -569,40 +915,12 @@ get_location (WindowMenu * wm, IndicatorObjectEntry * entry)
 	g_return_val_if_fail(IS_WINDOW_MENU_MODEL(wm), 0);
 	WindowMenuModel * menu = WINDOW_MENU_MODEL(wm);
 
-	gboolean found = FALSE;
-	guint pos = 0;
-
-	if (menu->priv->has_application_menu) {
-		if (entry == &menu->priv->application_menu) {
-			pos = 0;
-			found = TRUE;
-		} else {
-			/* We need to put a shift in if there is an application
-			   menu and we're not looking for that one */
-			pos = 1;
-		}
-	}
-
-	if (menu->priv->win_menu != NULL) {
-		GList * children = gtk_container_get_children(GTK_CONTAINER(menu->priv->win_menu));
-		GList * child;
-		for (child = children; child != NULL; child = g_list_next(child), pos++) {
-			gpointer lentry = g_object_get_data(child->data, ENTRY_DATA);
-
-			if (entry == lentry) {
-				found = TRUE;
-				break;
-			}
-		}
-
-		g_list_free(children);
-	}
+	guint pos = entries_find(menu, entry);
 
-	if (!found) {
+	if (pos == G_MAXUINT) {
 		/* NOTE: Not printing any of the values here because there's
 		   a pretty good chance that they're not valid.  Let's not crash
 		   things here. */
-		pos = G_MAXUINT;
 		g_warning("Unable to find entry: %p", entry);
 	}
 
@@ -24,6 +24,7 @@
 #include <glib-object.h>
 #include <libbamf/bamf-window.h>
 #include "window-menu.h"
+#include "window-props.h"
 
 G_BEGIN_DECLS
 
@@ -49,7 +50,7 @@ struct _WindowMenuModel {
 };
 
 GType window_menu_model_get_type (void);
-WindowMenuModel * window_menu_model_new (BamfApplication * app, BamfWindow * window);
+WindowMenuModel * window_menu_model_new (BamfApplication * app, BamfWindow * window, WindowProps * props);
 
 G_END_DECLS
 
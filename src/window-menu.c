@@ -32,6 +32,7 @@
 enum {
 	ENTRY_ADDED,
 	ENTRY_REMOVED,
+	ENTRY_MOVED,
 	ERROR_STATE,
 	STATUS_CHANGED,
 	SHOW_MENU,
@@ -73,6 +74,13 @@ window_menu_class_init (WindowMenuClass *klass)
 	                                      NULL, NULL,
 	                                      g_cclosure_marshal_VOID__POINTER,
 	                                      G_TYPE_NONE, 1, G_TYPE_POINTER);
+	signals[ENTRY_MOVED] =   g_signal_new(WINDOW_MENU_SIGNAL_ENTRY_MOVED,
+	                                      G_TYPE_FROM_CLASS(klass),
+	                                      G_SIGNAL_RUN_LAST,
+	                                      G_STRUCT_OFFSET (WindowMenuClass, entry_moved),
+	                                      NULL, NULL,
+	                                      _indicator_appmenu_marshal_VOID__POINTER_UINT_UINT,
+	                                      G_TYPE_NONE, 3, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_UINT);
 	signals[ERROR_STATE] =   g_signal_new(WINDOW_MENU_SIGNAL_ERROR_STATE,
 	                                      G_TYPE_FROM_CLASS(klass),
 	                                      G_SIGNAL_RUN_LAST,
@@ -142,9 +150,55 @@ window_menu_get_entries (WindowMenu * wm)
 
 	if (class->get_entries != NULL) {
 		return class->get_entries(wm);
-	} else {
-		return NULL;
 	}
+
+	/* Build a list from the borrowed ones */
+	guint n_entries = 0;
+	IndicatorObjectEntry * const * entries = window_menu_peek_entries(wm, &n_entries, NULL);
+	GList * output = NULL;
+
+	while (n_entries > 0) {
+		output = g_list_prepend(output, entries[--n_entries]);
+	}
+
+	return output;
+}
+
+/* Gets the entries without copying them.  The array belongs to the
+   menus and is only good until they change, which bumps the serial.
+   Backends without their own version get one built from get_entries
+   on each call. */
+IndicatorObjectEntry * const *
+window_menu_peek_entries (WindowMenu * wm, guint * n_entries, guint * serial)
+{
+	g_return_val_if_fail (IS_WINDOW_MENU(wm), NULL);
+	g_return_val_if_fail (n_entries != NULL, NULL);
+
+	WindowMenuClass * class = WINDOW_MENU_GET_CLASS(wm);
+
+	if (class->peek_entries != NULL) {
+		guint dummy;
+		return class->peek_entries(wm, n_entries, serial != NULL ? serial : &dummy);
+	}
+
+	static guint fallback_serial = 0;
+	GPtrArray * array = g_ptr_array_new();
+	GList * entries = class->get_entries != NULL ? class->get_entries(wm) : NULL;
+	GList * entry;
+
+	for (entry = entries; entry != NULL; entry = g_list_next(entry)) {
+		g_ptr_array_add(array, entry->data);
+	}
+	g_list_free(entries);
+
+	g_object_set_data_full(G_OBJECT(wm), "window-menu-peeked-entries", array, (GDestroyNotify)g_ptr_array_unref);
+
+	*n_entries = array->len;
+	if (serial != NULL) {
+		*serial = ++fallback_serial;
+	}
+
+	return (IndicatorObjectEntry * const *)array->pdata;
 }
 
 guint
@@ -230,3 +284,51 @@ window_menu_entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint
 		return;
 	}
 }
+
+/* Whether the menus have been built yet, menus that don't
+   build lazily always have been */
+gboolean
+window_menu_is_realized (WindowMenu * wm)
+{
+	g_return_val_if_fail (IS_WINDOW_MENU(wm), FALSE);
+
+	WindowMenuClass * class = WINDOW_MENU_GET_CLASS(wm);
+
+	if (class->is_realized != NULL) {
+		return class->is_realized(wm);
+	} else {
+		return TRUE;
+	}
+}
+
+/* Build the menus if they haven't been already, the entries
+   come in through the entry-added signal */
+void
+window_menu_realize (WindowMenu * wm)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+
+	WindowMenuClass * class = WINDOW_MENU_GET_CLASS(wm);
+
+	if (class->realize != NULL) {
+		return class->realize(wm);
+	} else {
+		return;
+	}
+}
+
+/* Drop the menus down to what's needed to build them again,
+   the entries are removed through the entry-removed signal */
+void
+window_menu_unrealize (WindowMenu * wm)
+{
+	g_return_if_fail (IS_WINDOW_MENU(wm));
+
+	WindowMenuClass * class = WINDOW_MENU_GET_CLASS(wm);
+
+	if (class->unrealize != NULL) {
+		return class->unrealize(wm);
+	} else {
+		return;
+	}
+}
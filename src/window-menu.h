@@ -36,6 +36,7 @@ G_BEGIN_DECLS
 
 #define WINDOW_MENU_SIGNAL_ENTRY_ADDED    "entry-added"
 #define WINDOW_MENU_SIGNAL_ENTRY_REMOVED  "entry-removed"
+#define WINDOW_MENU_SIGNAL_ENTRY_MOVED    "entry-moved"
 #define WINDOW_MENU_SIGNAL_ERROR_STATE    "error-state"
 #define WINDOW_MENU_SIGNAL_STATUS_CHANGED "status-changed"
 #define WINDOW_MENU_SIGNAL_SHOW_MENU      "show-menu"
@@ -55,6 +56,7 @@ struct _WindowMenuClass {
 
 	/* Virtual Funcs */
 	GList *          (*get_entries)      (WindowMenu * wm);
+	IndicatorObjectEntry * const * (*peek_entries) (WindowMenu * wm, guint * n_entries, guint * serial);
 	guint            (*get_location)     (WindowMenu * wm, IndicatorObjectEntry * entry);
 
 	guint            (*get_xid)          (WindowMenu * wm);
@@ -65,9 +67,14 @@ struct _WindowMenuClass {
 
 	void             (*entry_activate)   (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp);
 
+	gboolean         (*is_realized)      (WindowMenu * wm);
+	void             (*realize)          (WindowMenu * wm);
+	void             (*unrealize)        (WindowMenu * wm);
+
 	/* Signals */
 	void (*entry_added)    (WindowMenu * wm, IndicatorObjectEntry * entry, gpointer user_data);
 	void (*entry_removed)  (WindowMenu * wm, IndicatorObjectEntry * entry, gpointer user_data);
+	void (*entry_moved)    (WindowMenu * wm, IndicatorObjectEntry * entry, guint old_position, guint new_position, gpointer user_data);
 
 	void (*error_state)    (WindowMenu * wm, gboolean state, gpointer user_data);
 	void (*status_changed) (WindowMenu * wm, WindowMenuStatus status, gpointer user_data);
@@ -83,6 +90,7 @@ struct _WindowMenu {
 GType window_menu_get_type (void);
 
 GList * window_menu_get_entries (WindowMenu * wm);
+IndicatorObjectEntry * const * window_menu_peek_entries (WindowMenu * wm, guint * n_entries, guint * serial);
 guint window_menu_get_location (WindowMenu * wm, IndicatorObjectEntry * entry);
 
 guint window_menu_get_xid (WindowMenu * wm);
@@ -93,6 +101,10 @@ void window_menu_entry_restore (WindowMenu * wm, IndicatorObjectEntry * entry);
 
 void window_menu_entry_activate (WindowMenu * wm, IndicatorObjectEntry * entry, guint timestamp);
 
+gboolean window_menu_is_realized (WindowMenu * wm);
+void window_menu_realize (WindowMenu * wm);
+void window_menu_unrealize (WindowMenu * wm);
+
 G_END_DECLS
 
 #endif
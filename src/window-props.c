@@ -0,0 +1,119 @@
+/*
+Fetches the properties GTK sets on a window to say where its
+GMenuModel menus are, in a single round trip to the X server.
+
+Copyright 2015 Canonical Ltd.
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h> /* free() */
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <gdk/gdkx.h>
+
+#include "window-props.h"
+
+/* Object paths are short, anything longer than this is bogus */
+#define MAX_PROP_LONGS  256
+
+/* Gets the string out of a reply, if it's the type we asked for */
+static gchar *
+reply_to_string (xcb_connection_t * connection, xcb_get_property_cookie_t cookie, xcb_atom_t type)
+{
+	xcb_get_property_reply_t * reply = xcb_get_property_reply(connection, cookie, NULL);
+	gchar * value = NULL;
+
+	if (reply == NULL) {
+		return NULL;
+	}
+
+	if (reply->type == type && reply->format == 8) {
+		gint length = xcb_get_property_value_length(reply);
+
+		if (length > 0) {
+			value = g_strndup(xcb_get_property_value(reply), length);
+		}
+	}
+
+	free(reply);
+
+	return value;
+}
+
+/* Reads all of the GMenuModel properties of a window.  The requests
+   all go out before we wait for the first reply, so it costs a single
+   trip to the X server rather than one for each property.  Returns
+   whether the window has a unique bus name, without that none of the
+   rest are any use. */
+gboolean
+window_props_fetch (guint xid, WindowProps * props)
+{
+	g_return_val_if_fail(props != NULL, FALSE);
+
+	xcb_connection_t * connection = XGetXCBConnection(gdk_x11_get_default_xdisplay());
+	xcb_atom_t utf8 = gdk_x11_get_xatom_by_name("UTF8_STRING");
+
+	struct {
+		const gchar * name;
+		gchar ** value;
+		xcb_get_property_cookie_t cookie;
+	} fetches[] = {
+		{ "_GTK_UNIQUE_BUS_NAME",         &props->unique_bus_name },
+		{ "_GTK_APP_MENU_OBJECT_PATH",    &props->app_menu_object_path },
+		{ "_GTK_MENUBAR_OBJECT_PATH",     &props->menubar_object_path },
+		{ "_GTK_APPLICATION_OBJECT_PATH", &props->application_object_path },
+		{ "_GTK_WINDOW_OBJECT_PATH",      &props->window_object_path },
+		{ "_UNITY_OBJECT_PATH",           &props->unity_object_path },
+	};
+	guint i;
+
+	/* GDK caches the atoms, so these only go to the server once */
+	for (i = 0; i < G_N_ELEMENTS(fetches); i++) {
+		fetches[i].cookie = xcb_get_property(connection, FALSE, xid,
+		                                     gdk_x11_get_xatom_by_name(fetches[i].name),
+		                                     utf8, 0, MAX_PROP_LONGS);
+	}
+
+	/* An error, like the window being gone, comes back as a NULL
+	   reply so there's nothing to trap */
+	for (i = 0; i < G_N_ELEMENTS(fetches); i++) {
+		*fetches[i].value = reply_to_string(connection, fetches[i].cookie, utf8);
+	}
+
+	if (props->unique_bus_name == NULL) {
+		window_props_clear(props);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+window_props_clear (WindowProps * props)
+{
+	g_return_if_fail(props != NULL);
+
+	g_clear_pointer(&props->unique_bus_name, g_free);
+	g_clear_pointer(&props->app_menu_object_path, g_free);
+	g_clear_pointer(&props->menubar_object_path, g_free);
+	g_clear_pointer(&props->application_object_path, g_free);
+	g_clear_pointer(&props->window_object_path, g_free);
+	g_clear_pointer(&props->unity_object_path, g_free);
+}
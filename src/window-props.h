@@ -0,0 +1,44 @@
+/*
+The properties GTK sets on a window to say where its GMenuModel
+menus are, and a way to fetch them all at once.
+
+Copyright 2015 Canonical Ltd.
+
+This program is free software: you can redistribute it and/or modify it 
+under the terms of the GNU General Public License version 3, as published 
+by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but 
+WITHOUT ANY WARRANTY; without even the implied warranties of 
+MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR 
+PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along 
+with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __WINDOW_PROPS_H__
+#define __WINDOW_PROPS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The properties GTK sets on a window to say where its GMenuModel
+   menus and actions are exported.  All NULL when they're not set. */
+typedef struct _WindowProps WindowProps;
+struct _WindowProps {
+	gchar * unique_bus_name;
+	gchar * app_menu_object_path;
+	gchar * menubar_object_path;
+	gchar * application_object_path;
+	gchar * window_object_path;
+	gchar * unity_object_path;
+};
+
+gboolean window_props_fetch (guint xid, WindowProps * props);
+void window_props_clear (WindowProps * props);
+
+G_END_DECLS
+
+#endif